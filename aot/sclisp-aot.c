@@ -0,0 +1,1488 @@
+/**********************************************************************
+* Copyright 2020 Shawn M. Chapla
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+***********************************************************************/
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/***********************************************************************
+* Usage:
+*
+*     sclisp-aot [--name PREFIX] [--verbose] INPUT.lisp OUTPUT.c
+*
+* Translates a sclisp source file into a C source file defining
+*
+*     int PREFIX_register(struct sclisp *s);
+*
+* (PREFIX defaults to "sclisp_aot"). Calling it has the same effect as
+* loading INPUT.lisp into s: top-level forms run in order and stop at
+* the first error, whose code is returned.
+*
+* Top-level functions, defined with (set (name params...) body...) or
+* (set name (lambda (params...) body...)), are compiled to C when
+* their bodies only use numbers, nil, #t, #f, their parameters,
+* + - * / mod, the comparisons, cond, and calls to other compiled
+* functions. Parameters live in C variables, calls between compiled
+* functions are direct C calls, and each function is installed with
+* sclisp_register_user_func under its own name, so sclisp code calls
+* it as before. Compiled functions take and return numbers or nil;
+* any other argument is a SCLISP_BADARG error. Everything else in the
+* file is embedded as source and evaluated at registration.
+*
+* The compiler assumes that the names it compiles are not rebound at
+* run time, neither by the host nor by eval, load or import. Within
+* the file itself, a function is left interpreted if its name is set
+* more than once or used as a parameter anywhere, and nothing is
+* compiled if the file rebinds an operator, cond, #t or #f.
+*
+* The output includes sclisp.h, and also math.h if it uses mod, in
+* which case it may need to be linked with -lm.
+***********************************************************************/
+
+#define TOKEN_MAX   127
+#define NAME_MAX_   16
+
+/***********************************************************************
+* Errors
+***********************************************************************/
+
+static const char *input_path = "";
+
+static void fatal(unsigned long line, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (line)
+        fprintf(stderr, "sclisp-aot: %s:%lu: ", input_path, line);
+    else
+        fprintf(stderr, "sclisp-aot: ");
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static void* xalloc(size_t size)
+{
+    void *p = calloc(1, size ? size : 1);
+
+    if (!p)
+        fatal(0, "out of memory");
+
+    return p;
+}
+
+static char* xstrndup(const char *str, size_t len)
+{
+    char *p = xalloc(len + 1);
+
+    memcpy(p, str, len);
+    p[len] = '\0';
+
+    return p;
+}
+
+/***********************************************************************
+* Reader
+***********************************************************************/
+
+/* This follows the lexer in src/sclisp.c closely enough that the forms
+   it accepts read the same way there. Anything it cannot read is an
+   error rather than a guess. */
+
+enum NodeType {
+    N_INTEGER,
+    N_REAL,
+    N_STRING,
+    N_SYMBOL,
+    N_NIL,
+    N_LIST,
+    N_QUOTE
+};
+
+struct Node {
+    enum NodeType type;
+    long integer;
+    double real;
+    char *text;
+    struct Node *kids;
+    unsigned long nkids;
+    struct Node *next;
+    unsigned long start, end, line;
+};
+
+enum TokenType {
+    T_EOF,
+    T_LPAREN,
+    T_RPAREN,
+    T_QUOTE,
+    T_STRING,
+    T_ATOM
+};
+
+struct Token {
+    enum TokenType type;
+    char *text;
+    unsigned long start, end, line;
+};
+
+struct Reader {
+    const char *src;
+    unsigned long len, pos, line;
+};
+
+static void next_token(struct Reader *r, struct Token *t)
+{
+    char buf[TOKEN_MAX + 1];
+    unsigned long off = 0;
+    int string = 0;
+    char c;
+
+    t->text = NULL;
+
+    for (;;) {
+        while (r->pos < r->len && isspace((unsigned char)r->src[r->pos]))
+            if (r->src[r->pos++] == '\n')
+                ++r->line;
+        if (r->pos < r->len && r->src[r->pos] == ';') {
+            while (r->pos < r->len && r->src[r->pos] != '\n')
+                ++r->pos;
+            continue;
+        }
+        break;
+    }
+
+    t->start = r->pos;
+    t->line = r->line;
+
+    if (r->pos == r->len) {
+        t->type = T_EOF;
+        t->end = r->pos;
+        return;
+    }
+
+    switch (r->src[r->pos]) {
+        case '(':
+            t->type = T_LPAREN;
+            t->end = ++r->pos;
+            return;
+        case ')':
+            t->type = T_RPAREN;
+            t->end = ++r->pos;
+            return;
+        /* Backquotes and unquotes only matter as prefixes here; forms
+           using any of them are left to the interpreter. */
+        case '\'':
+        case '`':
+        case ',':
+            t->type = T_QUOTE;
+            if (r->src[r->pos++] == ',' && r->pos < r->len &&
+                    r->src[r->pos] == '@')
+                ++r->pos;
+            t->end = r->pos;
+            return;
+        default:
+            break;
+    }
+
+    /* Everything else runs up to whitespace, ')' or ';'. A '"' starts
+       a string, which ends the token where it closes. */
+    while (r->pos < r->len) {
+        c = r->src[r->pos];
+
+        if (c == '"') {
+            unsigned long from = ++r->pos;
+
+            while (r->pos < r->len && r->src[r->pos] != '"')
+                if (r->src[r->pos++] == '\n')
+                    ++r->line;
+            if (r->pos == r->len)
+                fatal(t->line, "unterminated string");
+
+            if (off) {
+                if (off + (r->pos - from) > TOKEN_MAX)
+                    fatal(t->line, "token too long");
+                memcpy(buf + off, r->src + from, r->pos - from);
+                off += r->pos - from;
+                t->text = xstrndup(buf, off);
+            } else
+                t->text = xstrndup(r->src + from, r->pos - from);
+
+            string = 1;
+            ++r->pos;
+            break;
+        }
+
+        if (isspace((unsigned char)c) || c == ')' || c == ';')
+            break;
+
+        if (off == TOKEN_MAX)
+            fatal(t->line, "token too long");
+        buf[off++] = c;
+        ++r->pos;
+    }
+
+    t->type = string ? T_STRING : T_ATOM;
+    t->end = r->pos;
+    if (!string)
+        t->text = xstrndup(buf, off);
+}
+
+static int scan_integer(const char *buf, long *out)
+{
+    int used = 0;
+    return sscanf(buf, "%li%n", out, &used) == 1 && used == (int)strlen(buf);
+}
+
+static int scan_real(const char *buf, double *out)
+{
+    int used = 0;
+    return sscanf(buf, "%lf%n", out, &used) == 1 && used == (int)strlen(buf);
+}
+
+static struct Node* read_form(struct Reader *r, struct Token *t)
+{
+    struct Node *n = xalloc(sizeof(*n)), **tail;
+    struct Token kid;
+
+    n->start = t->start;
+    n->line = t->line;
+
+    switch (t->type) {
+        case T_EOF:
+            fatal(t->line, "unexpected end of file");
+            break;
+        case T_RPAREN:
+            fatal(t->line, "unbalanced ')'");
+            break;
+        case T_LPAREN:
+            n->type = N_LIST;
+            tail = &n->kids;
+            for (;;) {
+                next_token(r, &kid);
+                if (kid.type == T_EOF)
+                    fatal(t->line, "unbalanced '('");
+                if (kid.type == T_RPAREN)
+                    break;
+                *tail = read_form(r, &kid);
+                tail = &(*tail)->next;
+                ++n->nkids;
+            }
+            /* () reads as nil. */
+            if (!n->nkids)
+                n->type = N_NIL;
+            t->end = kid.end;
+            break;
+        case T_QUOTE:
+            n->type = N_QUOTE;
+            next_token(r, &kid);
+            n->kids = read_form(r, &kid);
+            n->nkids = 1;
+            t->end = kid.end;
+            break;
+        case T_STRING:
+            n->type = N_STRING;
+            n->text = t->text;
+            break;
+        case T_ATOM:
+            n->text = t->text;
+            if (scan_integer(t->text, &n->integer))
+                n->type = N_INTEGER;
+            else if (scan_real(t->text, &n->real))
+                n->type = N_REAL;
+            else if (!strcmp(t->text, "nil"))
+                n->type = N_NIL;
+            else
+                n->type = N_SYMBOL;
+            break;
+    }
+
+    n->end = t->end;
+
+    return n;
+}
+
+static void node_free(struct Node *n)
+{
+    while (n) {
+        struct Node *next = n->next;
+
+        node_free(n->kids);
+        free(n->text);
+        free(n);
+
+        n = next;
+    }
+}
+
+static int is_symbol(const struct Node *n, const char *name)
+{
+    return n && n->type == N_SYMBOL && (!name || !strcmp(n->text, name));
+}
+
+/***********************************************************************
+* Analysis
+***********************************************************************/
+
+enum Op {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_LT,
+    OP_LTE,
+    OP_GT,
+    OP_GTE,
+    OP_EQ,
+    OP_COND,
+
+    OP_NONE = -1
+};
+
+static const struct {
+    const char *name;
+    const char *c_name;
+} ops[] = {
+    { "+", "AOT_ADD" },
+    { "-", "AOT_SUB" },
+    { "*", "AOT_MUL" },
+    { "/", "AOT_DIV" },
+    { "mod", "AOT_MOD" },
+    { "<", "AOT_LT" },
+    { "<=", "AOT_LTE" },
+    { ">", "AOT_GT" },
+    { ">=", "AOT_GTE" },
+    { "==", "AOT_EQ" },
+    { "cond", NULL }
+};
+
+#define OP_COUNT    (sizeof(ops) / sizeof(ops[0]))
+
+static enum Op op_by_name(const char *name)
+{
+    unsigned long i;
+
+    for (i = 0; i < OP_COUNT; ++i)
+        if (!strcmp(ops[i].name, name))
+            return (enum Op)i;
+
+    return OP_NONE;
+}
+
+/* Names whose meaning compiled code takes for granted. */
+static int is_reserved(const char *name)
+{
+    return op_by_name(name) != OP_NONE || !strcmp(name, "#t") ||
+        !strcmp(name, "#f");
+}
+
+static int is_binder(const char *name)
+{
+    return is_reserved(name) || !strcmp(name, "set") ||
+        !strcmp(name, "lambda");
+}
+
+struct Func {
+    const char *name;
+    char *c_name;
+    const struct Node *form;
+    const struct Node *params;
+    unsigned long nparams;
+    const struct Node *body;
+    int compiled;
+    const char *why;
+    const char *why_name;
+    unsigned temps;
+    int uses_rc;
+    unsigned char *used;
+};
+
+/* Every name bound anywhere in the file, by set or as a parameter. */
+struct Binding {
+    const char *name;
+    unsigned long sets;
+    int param;
+    struct Binding *next;
+};
+
+static struct Binding* binding(struct Binding **list, const char *name)
+{
+    struct Binding *b;
+
+    for (b = *list; b; b = b->next)
+        if (!strcmp(b->name, name))
+            return b;
+
+    b = xalloc(sizeof(*b));
+    b->name = name;
+    b->next = *list;
+    *list = b;
+
+    return b;
+}
+
+static void scan_params(struct Binding **list, const struct Node *p)
+{
+    for (; p; p = p->next)
+        if (p->type == N_SYMBOL)
+            binding(list, p->text)->param = 1;
+}
+
+static void scan_bindings(struct Binding **list, const struct Node *n)
+{
+    const struct Node *k;
+
+    if (n->type == N_LIST && n->kids->next) {
+        const struct Node *target = n->kids->next;
+
+        if (is_symbol(n->kids, "set")) {
+            if (target->type == N_SYMBOL)
+                ++binding(list, target->text)->sets;
+            else if (target->type == N_LIST &&
+                    target->kids->type == N_SYMBOL) {
+                ++binding(list, target->kids->text)->sets;
+                scan_params(list, target->kids->next);
+            }
+        } else if (is_symbol(n->kids, "lambda") && target->type == N_LIST)
+            scan_params(list, target->kids);
+    }
+
+    for (k = n->kids; k; k = k->next)
+        scan_bindings(list, k);
+}
+
+/* Fills in f if form defines a function at the top level. */
+static int find_candidate(const struct Node *form, struct Func *f)
+{
+    const struct Node *target, *lambda;
+
+    if (form->type != N_LIST || !is_symbol(form->kids, "set") ||
+            !(target = form->kids->next))
+        return 0;
+
+    memset(f, 0, sizeof(*f));
+    f->form = form;
+
+    if (target->type == N_LIST && target->kids->type == N_SYMBOL) {
+        f->name = target->kids->text;
+        f->params = target->kids->next;
+        f->body = target->next;
+    } else if (target->type == N_SYMBOL && form->nkids == 3 &&
+            (lambda = target->next)->type == N_LIST &&
+            is_symbol(lambda->kids, "lambda") && lambda->kids->next &&
+            (lambda->kids->next->type == N_LIST ||
+             lambda->kids->next->type == N_NIL)) {
+        f->name = target->text;
+        f->params = lambda->kids->next->kids;
+        f->body = lambda->kids->next->next;
+    } else
+        return 0;
+
+    return 1;
+}
+
+static void reject(struct Func *f, const char *why, const char *name)
+{
+    if (f->compiled) {
+        f->compiled = 0;
+        f->why = why;
+        f->why_name = name;
+    }
+}
+
+static struct Func* find_func(struct Func *funcs, unsigned long nfuncs,
+        const char *name)
+{
+    unsigned long i;
+
+    for (i = 0; i < nfuncs; ++i)
+        if (!strcmp(funcs[i].name, name))
+            return &funcs[i];
+
+    return NULL;
+}
+
+static int param_index(const struct Func *f, const char *name)
+{
+    const struct Node *p;
+    int i = 0;
+
+    for (p = f->params; p; p = p->next, ++i)
+        if (!strcmp(p->text, name))
+            return i;
+
+    return -1;
+}
+
+static void check_params(struct Func *f, struct Binding *bindings)
+{
+    const struct Node *p;
+    struct Binding *b = binding(&bindings, f->name);
+
+    f->compiled = 1;
+
+    if (b->sets != 1)
+        reject(f, "set more than once", NULL);
+    else if (b->param)
+        reject(f, "name is also a parameter", NULL);
+
+    for (p = f->params; p; p = p->next, ++f->nparams) {
+        if (p->type != N_SYMBOL)
+            reject(f, "parameter is not a symbol", NULL);
+        else if (is_binder(p->text))
+            reject(f, "parameter shadows", p->text);
+        else if (param_index(f, p->text) != (int)f->nparams)
+            reject(f, "repeated parameter", p->text);
+    }
+}
+
+static int finite(double d)
+{
+    return d == d && d - d == 0.0;
+}
+
+/* Checks that n is in the compiled subset, given the functions that
+   are still expected to compile. */
+static int check_expr(struct Func *f, struct Func *funcs,
+        unsigned long nfuncs, const struct Node *n)
+{
+    const struct Node *k;
+    struct Func *callee;
+    enum Op op;
+
+    switch (n->type) {
+        case N_INTEGER:
+        case N_NIL:
+            return 1;
+        case N_REAL:
+            if (!finite(n->real))
+                reject(f, "non-finite literal", n->text);
+            return f->compiled;
+        case N_STRING:
+            reject(f, "string literal", NULL);
+            return 0;
+        case N_QUOTE:
+            reject(f, "quote", NULL);
+            return 0;
+        case N_SYMBOL:
+            if (param_index(f, n->text) < 0 && strcmp(n->text, "#t") &&
+                    strcmp(n->text, "#f"))
+                reject(f, "free variable", n->text);
+            return f->compiled;
+        case N_LIST:
+            break;
+    }
+
+    if (n->kids->type != N_SYMBOL) {
+        reject(f, "computed call", NULL);
+        return 0;
+    }
+
+    if (param_index(f, n->kids->text) >= 0) {
+        reject(f, "call through parameter", n->kids->text);
+        return 0;
+    }
+
+    op = op_by_name(n->kids->text);
+    if (op == OP_COND) {
+        for (k = n->kids->next; k && f->compiled; k = k->next) {
+            if (k->type != N_LIST || k->nkids > 2)
+                reject(f, "malformed cond clause", NULL);
+            else if (check_expr(f, funcs, nfuncs, k->kids) && k->kids->next)
+                check_expr(f, funcs, nfuncs, k->kids->next);
+        }
+        return f->compiled;
+    }
+
+    if (op >= OP_LT && op <= OP_EQ && n->nkids != 3) {
+        reject(f, "comparison without two arguments", n->kids->text);
+        return 0;
+    }
+
+    if (op == OP_NONE) {
+        callee = find_func(funcs, nfuncs, n->kids->text);
+        if (!callee || !callee->compiled) {
+            reject(f, "calls something not compiled", n->kids->text);
+            return 0;
+        }
+        if (callee->nparams != n->nkids - 1) {
+            reject(f, "wrong number of arguments to", n->kids->text);
+            return 0;
+        }
+    }
+
+    for (k = n->kids->next; k && f->compiled; k = k->next)
+        check_expr(f, funcs, nfuncs, k);
+
+    return f->compiled;
+}
+
+/* Functions only compile if everything they call does, so drop them
+   until nothing else changes. */
+static void check_funcs(struct Func *funcs, unsigned long nfuncs)
+{
+    const struct Node *k;
+    unsigned long i;
+    int changed;
+
+    do {
+        changed = 0;
+        for (i = 0; i < nfuncs; ++i) {
+            if (!funcs[i].compiled)
+                continue;
+            for (k = funcs[i].body; k && funcs[i].compiled; k = k->next)
+                check_expr(&funcs[i], funcs, nfuncs, k);
+            changed |= !funcs[i].compiled;
+        }
+    } while (changed);
+}
+
+/* Symbols may use any character, so anything but letters and digits
+   is escaped, '_' included, to keep C names distinct. */
+static char* mangle(const char *name)
+{
+    char *out = xalloc(strlen(name) * 3 + 1), *p = out;
+
+    for (; *name; ++name) {
+        if (isalnum((unsigned char)*name))
+            *p++ = *name;
+        else if (*name == '_') {
+            *p++ = '_';
+            *p++ = '_';
+        } else
+            p += sprintf(p, "_%02x", (unsigned char)*name);
+    }
+    *p = '\0';
+
+    return out;
+}
+
+/***********************************************************************
+* Code generation
+***********************************************************************/
+
+#define H_INT       0x001
+#define H_REAL      0x002
+#define H_NIL       0x004
+#define H_NUM       0x008
+#define H_PROMOTE   0x010
+#define H_MATH      0x020
+#define H_MOD       0x040
+#define H_COMPARE   0x080
+#define H_TRUE      0x100
+#define H_EVAL      0x200
+
+struct Gen {
+    FILE *out;
+    struct Func *funcs;
+    unsigned long nfuncs;
+    struct Func *f;
+    unsigned temps;
+    int indent;
+    unsigned helpers;
+};
+
+/* Nothing is written on the first pass over a function, which only
+   counts its temporaries and notes what it uses. */
+static void emit(struct Gen *g, const char *fmt, ...)
+{
+    va_list ap;
+    int i;
+
+    if (!g->out)
+        return;
+
+    for (i = 0; i < g->indent; ++i)
+        fputs("    ", g->out);
+
+    va_start(ap, fmt);
+    vfprintf(g->out, fmt, ap);
+    va_end(ap);
+
+    fputc('\n', g->out);
+}
+
+static void new_temp(struct Gen *g, char *name)
+{
+    sprintf(name, "t%u", g->temps++);
+}
+
+static void int_literal(char *buf, long v)
+{
+    if (v == LONG_MIN)
+        sprintf(buf, "(-%ldL - 1)", LONG_MAX);
+    else
+        sprintf(buf, "%ldL", v);
+}
+
+static void real_literal(char *buf, double v)
+{
+    sprintf(buf, "%.17g", v);
+    if (!strpbrk(buf, ".e"))
+        strcat(buf, ".0");
+}
+
+static void gen_expr(struct Gen *g, const struct Node *n, char *name);
+
+static void gen_math(struct Gen *g, const struct Node *n, enum Op op,
+        char *name)
+{
+    const struct Node *k = n->kids->next;
+    char val[NAME_MAX_];
+
+    new_temp(g, name);
+    g->f->uses_rc |= k != NULL;
+    g->helpers |= H_INT;
+
+    /* As in math_apply: + and * start from their identity, the others
+       from their first operand if they have two or more, else 1. */
+    if (op == OP_ADD)
+        emit(g, "%s = aot_int(0L);", name);
+    else if (op == OP_MUL || !k || !k->next)
+        emit(g, "%s = aot_int(1L);", name);
+    else {
+        gen_expr(g, k, val);
+        g->helpers |= H_NUM;
+        emit(g, "%s = aot_num(%s);", name, val);
+        k = k->next;
+    }
+
+    for (; k; k = k->next) {
+        gen_expr(g, k, val);
+        g->helpers |= H_MATH | H_NUM | H_PROMOTE | (op == OP_MOD ? H_MOD : 0);
+        emit(g, "if ((rc = aot_math(%s, &%s, %s)))", ops[op].c_name, name,
+                val);
+        emit(g, "    return rc;");
+    }
+}
+
+static void gen_cond(struct Gen *g, const struct Node *n, char *name)
+{
+    const struct Node *k;
+    char val[NAME_MAX_];
+    int depth = 0;
+
+    new_temp(g, name);
+    g->helpers |= H_NIL;
+
+    for (k = n->kids->next; k; k = k->next, ++depth) {
+        gen_expr(g, k->kids, val);
+        g->helpers |= H_TRUE;
+        emit(g, "if (aot_true(%s)) {", val);
+        ++g->indent;
+        if (k->kids->next) {
+            gen_expr(g, k->kids->next, val);
+            emit(g, "%s = %s;", name, val);
+        } else
+            emit(g, "%s = aot_nil();", name);
+        --g->indent;
+        emit(g, "} else {");
+        ++g->indent;
+    }
+
+    emit(g, "%s = aot_nil();", name);
+
+    while (depth--) {
+        --g->indent;
+        emit(g, "}");
+    }
+}
+
+static void gen_call(struct Gen *g, const struct Node *n, char *name)
+{
+    struct Func *callee = find_func(g->funcs, g->nfuncs, n->kids->text);
+    const struct Node *k;
+    char *call, *p;
+
+    call = p = xalloc(strlen(callee->c_name) + n->nkids * (NAME_MAX_ + 2) +
+            32);
+    p += sprintf(p, "if ((rc = f_%s(", callee->c_name);
+
+    for (k = n->kids->next; k; k = k->next) {
+        gen_expr(g, k, p);
+        p += strlen(p);
+        p += sprintf(p, ", ");
+    }
+
+    new_temp(g, name);
+    sprintf(p, "&%s)))", name);
+    g->f->uses_rc = 1;
+
+    emit(g, "%s", call);
+    emit(g, "    return rc;");
+
+    free(call);
+}
+
+static void gen_expr(struct Gen *g, const struct Node *n, char *name)
+{
+    char lit[64], a[NAME_MAX_], b[NAME_MAX_];
+    enum Op op;
+    int i;
+
+    switch (n->type) {
+        case N_INTEGER:
+            new_temp(g, name);
+            int_literal(lit, n->integer);
+            g->helpers |= H_INT;
+            emit(g, "%s = aot_int(%s);", name, lit);
+            return;
+        case N_REAL:
+            new_temp(g, name);
+            real_literal(lit, n->real);
+            g->helpers |= H_REAL;
+            emit(g, "%s = aot_real(%s);", name, lit);
+            return;
+        case N_SYMBOL:
+            if ((i = param_index(g->f, n->text)) >= 0) {
+                sprintf(name, "v%d", i);
+                g->f->used[i] = 1;
+                return;
+            }
+            new_temp(g, name);
+            g->helpers |= H_INT;
+            emit(g, "%s = aot_int(%s);", name,
+                    strcmp(n->text, "#t") ? "0L" : "1L");
+            return;
+        case N_LIST:
+            break;
+        default:
+            new_temp(g, name);
+            g->helpers |= H_NIL;
+            emit(g, "%s = aot_nil();", name);
+            return;
+    }
+
+    op = op_by_name(n->kids->text);
+    switch (op) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+            gen_math(g, n, op, name);
+            break;
+        case OP_LT:
+        case OP_LTE:
+        case OP_GT:
+        case OP_GTE:
+        case OP_EQ:
+            gen_expr(g, n->kids->next, a);
+            gen_expr(g, n->kids->next->next, b);
+            new_temp(g, name);
+            g->helpers |= H_COMPARE | H_PROMOTE | H_NUM | H_INT;
+            emit(g, "%s = aot_compare(%s, %s, %s);", name, ops[op].c_name,
+                    a, b);
+            break;
+        case OP_COND:
+            gen_cond(g, n, name);
+            break;
+        case OP_NONE:
+            gen_call(g, n, name);
+            break;
+    }
+}
+
+static void gen_body(struct Gen *g, struct Func *f)
+{
+    const struct Node *k;
+    char name[NAME_MAX_];
+
+    g->f = f;
+    g->temps = 0;
+    g->indent = 1;
+
+    if (!f->body) {
+        g->helpers |= H_NIL;
+        emit(g, "*out = aot_nil();");
+    }
+
+    for (k = f->body; k; k = k->next) {
+        gen_expr(g, k, name);
+        if (k->next)
+            emit(g, "(void)%s;", name);
+        else
+            emit(g, "*out = %s;", name);
+    }
+
+    if (g->out)
+        fputs("\n    return SCLISP_OK;\n", g->out);
+}
+
+static void gen_signature(FILE *out, const struct Func *f, const char *end)
+{
+    unsigned long i;
+
+    fprintf(out, "static int f_%s(", f->c_name);
+    for (i = 0; i < f->nparams; ++i)
+        fprintf(out, "struct sclisp_number v%lu, ", i);
+    fprintf(out, "struct sclisp_number *out)%s\n", end);
+}
+
+static void gen_function(struct Gen *g, struct Func *f)
+{
+    unsigned long i;
+
+    gen_signature(g->out, f, "");
+    fputs("{\n", g->out);
+
+    for (i = 0; i < f->temps; ++i)
+        fprintf(g->out, "%s t%lu%s", i % 8 ? "," : "    struct sclisp_number",
+                i, i % 8 == 7 || i + 1 == f->temps ? ";\n" : "");
+    if (f->uses_rc)
+        fputs("    int rc;\n", g->out);
+    if (f->temps || f->uses_rc)
+        fputc('\n', g->out);
+
+    for (i = 0; i < f->nparams; ++i)
+        if (!f->used[i])
+            fprintf(g->out, "    (void)v%lu;\n", i);
+
+    gen_body(g, f);
+    fputs("}\n\n", g->out);
+}
+
+static void gen_entry(FILE *out, const struct Func *f)
+{
+    unsigned long i;
+
+    fprintf(out, "static int entry_%s(const struct sclisp_func_api *api, "
+            "void *user)\n{\n    struct sclisp_number ", f->c_name);
+    for (i = 0; i < f->nparams; ++i)
+        fprintf(out, "a%lu, ", i);
+    fputs("ret;\n    int rc;\n\n    (void)user;\n\n", out);
+
+    for (i = 0; i < f->nparams; ++i)
+        fprintf(out, "    if ((rc = api->arg_number(api, %lu, &a%lu)))\n"
+                "        return rc;\n", i, i);
+
+    fprintf(out, "    if ((rc = f_%s(", f->c_name);
+    for (i = 0; i < f->nparams; ++i)
+        fprintf(out, "a%lu, ", i);
+    fputs("&ret)))\n        return rc;\n\n"
+            "    return api->return_number(api, &ret);\n}\n\n", out);
+}
+
+/* Writes len bytes of text as one or more C string literals, one per
+   source line and never long enough to upset a C89 compiler. */
+static void gen_string(FILE *out, const char *text, unsigned long len,
+        const char *indent)
+{
+    unsigned long i, run = 0;
+
+    fprintf(out, "%s\"", indent);
+    for (i = 0; i < len; ++i, ++run) {
+        unsigned char c = text[i];
+
+        if (run == 256) {
+            fprintf(out, "\",\n%s\"", indent);
+            run = 0;
+        }
+
+        if (c == '\\' || c == '"' || c == '?')
+            fprintf(out, "\\%c", c);
+        else if (c == '\n') {
+            fputs("\\n", out);
+            if (i + 1 < len) {
+                fprintf(out, "\",\n%s\"", indent);
+                run = 0;
+            }
+        } else if (c == '\t')
+            fputs("\\t", out);
+        else if (c < 0x20 || c > 0x7e)
+            fprintf(out, "\\%03o", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static const char *const helper_int[] = {
+    "static struct sclisp_number aot_int(long i)",
+    "{",
+    "    struct sclisp_number n;",
+    "",
+    "    n.type = SCLISP_NUMBER_INTEGER;",
+    "    n.i = i;",
+    "    n.r = 0.0;",
+    "",
+    "    return n;",
+    "}",
+    NULL
+};
+
+static const char *const helper_real[] = {
+    "static struct sclisp_number aot_real(double r)",
+    "{",
+    "    struct sclisp_number n;",
+    "",
+    "    n.type = SCLISP_NUMBER_REAL;",
+    "    n.i = 0;",
+    "    n.r = r;",
+    "",
+    "    return n;",
+    "}",
+    NULL
+};
+
+static const char *const helper_nil[] = {
+    "static struct sclisp_number aot_nil(void)",
+    "{",
+    "    struct sclisp_number n;",
+    "",
+    "    n.type = SCLISP_NUMBER_NIL;",
+    "    n.i = 0;",
+    "    n.r = 0.0;",
+    "",
+    "    return n;",
+    "}",
+    NULL
+};
+
+static const char *const helper_num[] = {
+    "/* Arithmetic treats nil as 0. */",
+    "static struct sclisp_number aot_num(struct sclisp_number n)",
+    "{",
+    "    if (n.type == SCLISP_NUMBER_NIL) {",
+    "        n.type = SCLISP_NUMBER_INTEGER;",
+    "        n.i = 0;",
+    "    }",
+    "",
+    "    return n;",
+    "}",
+    NULL
+};
+
+static const char *const helper_promote[] = {
+    "static void aot_promote(struct sclisp_number *a, "
+        "struct sclisp_number *b)",
+    "{",
+    "    *a = aot_num(*a);",
+    "    *b = aot_num(*b);",
+    "",
+    "    if (a->type == SCLISP_NUMBER_REAL && "
+        "b->type == SCLISP_NUMBER_INTEGER) {",
+    "        b->type = SCLISP_NUMBER_REAL;",
+    "        b->r = b->i;",
+    "    } else if (b->type == SCLISP_NUMBER_REAL && "
+        "a->type == SCLISP_NUMBER_INTEGER) {",
+    "        a->type = SCLISP_NUMBER_REAL;",
+    "        a->r = a->i;",
+    "    }",
+    "}",
+    NULL
+};
+
+static const char *const helper_math[] = {
+    "static int aot_math(int op, struct sclisp_number *acc,",
+    "        struct sclisp_number val)",
+    "{",
+    "    aot_promote(acc, &val);",
+    "",
+    "    if ((op == AOT_DIV || op == AOT_MOD) &&",
+    "            (val.type == SCLISP_NUMBER_INTEGER ? !val.i : "
+        "val.r == 0.0))",
+    "        return SCLISP_BADARG;",
+    "",
+    "    if (acc->type == SCLISP_NUMBER_INTEGER) {",
+    "        switch (op) {",
+    "            case AOT_ADD: acc->i += val.i; break;",
+    "            case AOT_SUB: acc->i -= val.i; break;",
+    "            case AOT_MUL: acc->i *= val.i; break;",
+    "            case AOT_DIV: acc->i /= val.i; break;",
+    "            case AOT_MOD: acc->i %= val.i; break;",
+    "        }",
+    "    } else {",
+    "        switch (op) {",
+    "            case AOT_ADD: acc->r += val.r; break;",
+    "            case AOT_SUB: acc->r -= val.r; break;",
+    "            case AOT_MUL: acc->r *= val.r; break;",
+    "            case AOT_DIV: acc->r /= val.r; break;",
+    "%s",
+    "        }",
+    "    }",
+    "",
+    "    return SCLISP_OK;",
+    "}",
+    NULL
+};
+
+static const char *const helper_compare[] = {
+    "static struct sclisp_number aot_compare(int op, "
+        "struct sclisp_number l,",
+    "        struct sclisp_number r)",
+    "{",
+    "    int res;",
+    "",
+    "    aot_promote(&l, &r);",
+    "",
+    "    if (l.type == SCLISP_NUMBER_INTEGER) {",
+    "        switch (op) {",
+    "            case AOT_LT: res = l.i < r.i; break;",
+    "            case AOT_LTE: res = l.i <= r.i; break;",
+    "            case AOT_GT: res = l.i > r.i; break;",
+    "            case AOT_GTE: res = l.i >= r.i; break;",
+    "            default: res = l.i == r.i; break;",
+    "        }",
+    "    } else {",
+    "        switch (op) {",
+    "            case AOT_LT: res = l.r < r.r; break;",
+    "            case AOT_LTE: res = l.r <= r.r; break;",
+    "            case AOT_GT: res = l.r > r.r; break;",
+    "            case AOT_GTE: res = l.r >= r.r; break;",
+    "            default: res = l.r == r.r; break;",
+    "        }",
+    "    }",
+    "",
+    "    return aot_int(res);",
+    "}",
+    NULL
+};
+
+static const char *const helper_true[] = {
+    "static int aot_true(struct sclisp_number n)",
+    "{",
+    "    if (n.type == SCLISP_NUMBER_INTEGER)",
+    "        return n.i != 0;",
+    "    if (n.type == SCLISP_NUMBER_REAL)",
+    "        return n.r != 0.0;",
+    "",
+    "    return 0;",
+    "}",
+    NULL
+};
+
+static const char *const helper_eval[] = {
+    "/* Evaluates one top-level form, stored in pieces. */",
+    "static int aot_eval(struct sclisp *s, const char *const *src)",
+    "{",
+    "    unsigned long len = 0, i;",
+    "    char *buf;",
+    "    int rc;",
+    "",
+    "    for (i = 0; src[i]; ++i)",
+    "        len += strlen(src[i]);",
+    "    if (!(buf = malloc(len + 1)))",
+    "        return SCLISP_NOMEM;",
+    "",
+    "    for (len = 0, i = 0; src[i]; ++i) {",
+    "        strcpy(buf + len, src[i]);",
+    "        len += strlen(src[i]);",
+    "    }",
+    "",
+    "    rc = sclisp_eval(s, buf);",
+    "    free(buf);",
+    "",
+    "    return rc;",
+    "}",
+    NULL
+};
+
+static void gen_helper(FILE *out, unsigned helpers, unsigned which,
+        const char *const *lines)
+{
+    if (!(helpers & which))
+        return;
+
+    for (; *lines; ++lines) {
+        if (!strcmp(*lines, "%s")) {
+            if (helpers & H_MOD)
+                fputs("            case AOT_MOD: acc->r = fmod(acc->r, "
+                        "val.r); break;\n", out);
+            continue;
+        }
+        fprintf(out, "%s\n", *lines);
+    }
+    fputc('\n', out);
+}
+
+static struct Func* compiled_func(struct Func *funcs, unsigned long nfuncs,
+        const struct Node *form)
+{
+    unsigned long i;
+
+    for (i = 0; i < nfuncs; ++i)
+        if (funcs[i].form == form)
+            return funcs[i].compiled ? &funcs[i] : NULL;
+
+    return NULL;
+}
+
+static void generate(FILE *out, const char *prefix, const char *src,
+        const struct Node *forms, struct Func *funcs, unsigned long nfuncs)
+{
+    const struct Node *n;
+    struct Func *f;
+    unsigned long i;
+    struct Gen g;
+
+    memset(&g, 0, sizeof(g));
+    g.funcs = funcs;
+    g.nfuncs = nfuncs;
+
+    for (i = 0; i < nfuncs; ++i) {
+        if (!funcs[i].compiled)
+            continue;
+        gen_body(&g, &funcs[i]);
+        funcs[i].temps = g.temps;
+    }
+
+    for (n = forms; n; n = n->next)
+        if (!compiled_func(funcs, nfuncs, n))
+            g.helpers |= H_EVAL;
+
+    fprintf(out, "/* Generated by sclisp-aot. Do not edit.\n"
+            " *\n"
+            " *     int %s_register(struct sclisp *s);\n"
+            " */\n\n", prefix);
+
+    if (g.helpers & H_MOD)
+        fputs("#include <math.h>\n", out);
+    fputs("#include <stdlib.h>\n#include <string.h>\n\n"
+            "#include \"sclisp.h\"\n\n", out);
+
+    if (g.helpers & (H_MATH | H_COMPARE))
+        fputs("enum {\n    AOT_ADD,\n    AOT_SUB,\n    AOT_MUL,\n"
+                "    AOT_DIV,\n    AOT_MOD,\n    AOT_LT,\n    AOT_LTE,\n"
+                "    AOT_GT,\n    AOT_GTE,\n    AOT_EQ\n};\n\n", out);
+
+    gen_helper(out, g.helpers, H_INT, helper_int);
+    gen_helper(out, g.helpers, H_REAL, helper_real);
+    gen_helper(out, g.helpers, H_NIL, helper_nil);
+    gen_helper(out, g.helpers, H_NUM, helper_num);
+    gen_helper(out, g.helpers, H_PROMOTE, helper_promote);
+    gen_helper(out, g.helpers, H_MATH, helper_math);
+    gen_helper(out, g.helpers, H_COMPARE, helper_compare);
+    gen_helper(out, g.helpers, H_TRUE, helper_true);
+    gen_helper(out, g.helpers, H_EVAL, helper_eval);
+
+    /* Compiled functions may call each other in any order. */
+    for (i = 0; i < nfuncs; ++i)
+        if (funcs[i].compiled)
+            gen_signature(out, &funcs[i], ";");
+    for (i = 0; i < nfuncs; ++i)
+        if (funcs[i].compiled)
+            break;
+    if (i < nfuncs)
+        fputc('\n', out);
+
+    g.out = out;
+    for (i = 0; i < nfuncs; ++i) {
+        if (!funcs[i].compiled)
+            continue;
+        gen_function(&g, &funcs[i]);
+        gen_entry(out, &funcs[i]);
+    }
+
+    for (n = forms, i = 0; n; n = n->next, ++i) {
+        if (compiled_func(funcs, nfuncs, n))
+            continue;
+        fprintf(out, "static const char *const src_%lu[] = {\n", i);
+        gen_string(out, src + n->start, n->end - n->start, "    ");
+        fputs(",\n    NULL\n};\n\n", out);
+    }
+
+    fprintf(out, "int %s_register(struct sclisp *s);\n\n"
+            "int %s_register(struct sclisp *s)\n{\n", prefix, prefix);
+
+    if (forms)
+        fputs("    int rc;\n\n", out);
+    else
+        fputs("    (void)s;\n\n", out);
+
+    for (n = forms, i = 0; n; n = n->next, ++i) {
+        if ((f = compiled_func(funcs, nfuncs, n))) {
+            fprintf(out, "    if ((rc = sclisp_register_user_func(s, "
+                    "entry_%s,\n            ", f->c_name);
+            gen_string(out, f->name, strlen(f->name), "");
+            fputs(", NULL, NULL)))\n", out);
+        } else
+            fprintf(out, "    if ((rc = aot_eval(s, src_%lu)))\n", i);
+        fputs("        return rc;\n", out);
+    }
+    if (forms)
+        fputc('\n', out);
+
+    fputs("    return SCLISP_OK;\n}\n", out);
+}
+
+/***********************************************************************
+* Main
+***********************************************************************/
+
+static char* read_file(const char *path, unsigned long *len_out)
+{
+    FILE *f = fopen(path, "rb");
+    char *buf = NULL;
+    long len;
+
+    if (!f)
+        return NULL;
+
+    if (!fseek(f, 0, SEEK_END) && (len = ftell(f)) >= 0 &&
+            !fseek(f, 0, SEEK_SET) && (buf = malloc(len + 1))) {
+        if (fread(buf, 1, len, f) != (size_t)len) {
+            free(buf);
+            buf = NULL;
+        } else {
+            buf[len] = '\0';
+            *len_out = len;
+        }
+    }
+
+    fclose(f);
+    return buf;
+}
+
+static int is_identifier(const char *name)
+{
+    if (!isalpha((unsigned char)*name) && *name != '_')
+        return 0;
+
+    while (*++name)
+        if (!isalnum((unsigned char)*name) && *name != '_')
+            return 0;
+
+    return 1;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [--name PREFIX] [--verbose] INPUT.lisp OUTPUT.c\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *prefix = "sclisp_aot", *output = NULL;
+    struct Node *forms = NULL, **tail = &forms, *n;
+    struct Binding *bindings = NULL, *b;
+    struct Func *funcs;
+    unsigned long nfuncs = 0, i;
+    struct Reader r;
+    struct Token t;
+    int verbose = 0;
+    char *src;
+    FILE *out;
+
+    for (i = 1; i < (unsigned long)argc; ++i) {
+        if (!strcmp(argv[i], "--verbose"))
+            verbose = 1;
+        else if (i + 1 < (unsigned long)argc && !strcmp(argv[i], "--name"))
+            prefix = argv[++i];
+        else if (argv[i][0] == '-' || output)
+            break;
+        else if (*input_path)
+            output = argv[i];
+        else
+            input_path = argv[i];
+    }
+
+    if (i < (unsigned long)argc || !output || !is_identifier(prefix)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    memset(&r, 0, sizeof(r));
+    if (!(src = read_file(input_path, &r.len))) {
+        perror(input_path);
+        return 1;
+    }
+    r.src = src;
+    r.line = 1;
+
+    for (;;) {
+        next_token(&r, &t);
+        if (t.type == T_EOF)
+            break;
+        *tail = read_form(&r, &t);
+        tail = &(*tail)->next;
+        ++nfuncs;
+    }
+
+    for (n = forms; n; n = n->next)
+        scan_bindings(&bindings, n);
+
+    funcs = xalloc(nfuncs * sizeof(*funcs));
+    for (nfuncs = 0, n = forms; n; n = n->next)
+        if (find_candidate(n, &funcs[nfuncs]))
+            check_params(&funcs[nfuncs++], bindings);
+
+    for (b = bindings; b; b = b->next) {
+        if (!is_binder(b->name))
+            continue;
+        for (i = 0; i < nfuncs; ++i)
+            reject(&funcs[i], "file rebinds", b->name);
+    }
+
+    check_funcs(funcs, nfuncs);
+
+    for (i = 0; i < nfuncs; ++i) {
+        funcs[i].c_name = mangle(funcs[i].name);
+        funcs[i].used = xalloc(funcs[i].nparams);
+
+        if (!verbose)
+            continue;
+        if (funcs[i].compiled)
+            fprintf(stderr, "%s: compiled\n", funcs[i].name);
+        else
+            fprintf(stderr, "%s: interpreted (%s%s%s)\n", funcs[i].name,
+                    funcs[i].why, funcs[i].why_name ? " " : "",
+                    funcs[i].why_name ? funcs[i].why_name : "");
+    }
+
+    if (!(out = fopen(output, "w"))) {
+        perror(output);
+        return 1;
+    }
+
+    generate(out, prefix, src, forms, funcs, nfuncs);
+
+    if (ferror(out) | fclose(out)) {
+        perror(output);
+        remove(output);
+        return 1;
+    }
+
+    for (i = 0; i < nfuncs; ++i) {
+        free(funcs[i].c_name);
+        free(funcs[i].used);
+    }
+    free(funcs);
+    while ((b = bindings)) {
+        bindings = b->next;
+        free(b);
+    }
+    node_free(forms);
+    free(src);
+
+    return 0;
+}
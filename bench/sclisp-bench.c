@@ -0,0 +1,751 @@
+/**********************************************************************
+* Copyright 2020 Shawn M. Chapla
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+***********************************************************************/
+
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sclisp.h"
+
+/***********************************************************************
+* Usage:
+*
+*     sclisp-bench [--filter SUBSTR] [--min-time SECONDS] [--large]
+*                  [--output FILE] [--baseline FILE] [--threshold PCT]
+*
+* Every benchmark is run in batches whose size doubles until a batch
+* takes at least --min-time seconds. The batch is then repeated and
+* the fastest repetition is reported, along with the spread between
+* the fastest and slowest repetitions as noise_pct. Results are
+* written as JSON, one benchmark per line, so that a previous run can
+* be passed back in with --baseline. When a baseline is given, a
+* comparison table is printed to stderr and the exit status is
+* non-zero if any benchmark allocates more than it did before.
+* Timings are only checked when --threshold is given: a benchmark then
+* regresses when it is slower by more than that many percent plus the
+* noise measured in either run.
+***********************************************************************/
+
+#define BENCH_REPEAT        3
+#define BENCH_MAX_BATCH     (1UL << 30)
+#define ALLOC_TOLERANCE     0.01
+
+/***********************************************************************
+* Counting allocator
+***********************************************************************/
+
+struct AllocCount {
+    unsigned long allocs;
+    unsigned long bytes;
+};
+
+static void* count_alloc_func(struct sclisp_cb *cb, unsigned long sz)
+{
+    struct AllocCount *count = cb->user;
+
+    ++count->allocs;
+    count->bytes += sz;
+
+    return malloc(sz);
+}
+
+static void* count_zalloc_func(struct sclisp_cb *cb, unsigned long sz)
+{
+    struct AllocCount *count = cb->user;
+
+    ++count->allocs;
+    count->bytes += sz;
+
+    return calloc(1, sz);
+}
+
+static void count_free_func(struct sclisp_cb *cb, void *mem)
+{
+    (void)cb;
+    free(mem);
+}
+
+/* Output is discarded so that repr measures formatting, not the
+   terminal. */
+static void null_print_func(struct sclisp_cb *cb, int fd, const char *str)
+{
+    (void)cb;
+    (void)fd;
+    (void)str;
+}
+
+static char null_getchar_func(struct sclisp_cb *cb)
+{
+    (void)cb;
+    return '\n';
+}
+
+static struct AllocCount alloc_count;
+
+static struct sclisp_cb count_cb = {
+    count_alloc_func,
+    count_zalloc_func,
+    count_free_func,
+    null_print_func,
+    null_getchar_func,
+    &alloc_count
+};
+
+/***********************************************************************
+* Timing
+***********************************************************************/
+
+static double now_ns(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+#else
+    return clock() * (1e9 / CLOCKS_PER_SEC);
+#endif
+}
+
+/***********************************************************************
+* Benchmark definitions
+***********************************************************************/
+
+struct BenchCtx {
+    struct sclisp *s;
+    const char *expr;
+    char *doc;
+    unsigned long doc_len;
+};
+
+struct Bench {
+    const char *name;
+    int (*setup)(struct BenchCtx *ctx);
+    int (*run)(struct BenchCtx *ctx);
+    const char *expr;
+    int large;
+};
+
+static int run_eval(struct BenchCtx *ctx)
+{
+    return sclisp_eval(ctx->s, ctx->expr);
+}
+
+static int eval_all(struct sclisp *s, const char * const *exprs)
+{
+    for (; *exprs; ++exprs)
+        if (sclisp_eval(s, *exprs) != SCLISP_OK)
+            return -1;
+
+    return 0;
+}
+
+static const char * const FUNCTION_DEFS[] = {
+    "(set (fib n) (cond ((< n 2) n) (#t (+ (fib (- n 1)) (fib (- n 2))))))",
+    "(set (sum-to n acc) "
+        "(cond ((== n 0) acc) (#t (sum-to (- n 1) (+ acc n)))))",
+    "(set (build acc n) "
+        "(cond ((== n 0) acc) (#t (build (cons n acc) (- n 1)))))",
+    "(set (walk l n) (cond ((nil? l) n) (#t (walk (cdr l) (+ n 1)))))",
+    "(set (add a b) (+ a b))",
+    "(set big (build nil 200))",
+    "(set big2 (build nil 200))",
+    "(set (h6 x) (- x 4))",
+    "(set (h5 x) (h6 (+ x 1)))",
+    "(set (h4 x) (h5 (+ x 1)))",
+    "(set (h3 x) (h4 (+ x 1)))",
+    "(set (h2 x) (h3 (+ x 1)))",
+    "(set (h1 x) (h2 (+ x 1)))",
+    "(set (chain n acc) "
+        "(cond ((== n 0) acc) (#t (chain (- n 1) (h1 acc)))))",
+    NULL
+};
+
+static int native_add(const struct sclisp_func_api *api, void *user)
+{
+    long a, b;
+
+    (void)user;
+
+    if (api->arg_integer(api, 0, &a) || api->arg_integer(api, 1, &b))
+        return SCLISP_BADARG;
+
+    return api->return_integer(api, a + b);
+}
+
+static int setup_functions(struct BenchCtx *ctx)
+{
+    if (sclisp_register_user_func(ctx->s, native_add, "native-add", NULL,
+                NULL) != SCLISP_OK)
+        return -1;
+
+    return eval_all(ctx->s, FUNCTION_DEFS);
+}
+
+static int setup_scope(struct BenchCtx *ctx, unsigned long n)
+{
+    const struct sclisp_scope_api *api = sclisp_get_scope_api(ctx->s);
+    char sym[32];
+    unsigned long i;
+
+    /* Bindings are prepended, so v0 is the deepest of them. */
+    for (i = 0; i < n; ++i) {
+        sprintf(sym, "v%lu", i);
+        if (api->set_integer(api, sym, (long)i) != SCLISP_OK)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int setup_scope_10(struct BenchCtx *ctx)
+{
+    return setup_scope(ctx, 10);
+}
+
+static int setup_scope_100(struct BenchCtx *ctx)
+{
+    return setup_scope(ctx, 100);
+}
+
+static int setup_scope_1000(struct BenchCtx *ctx)
+{
+    return setup_scope(ctx, 1000);
+}
+
+/* Build a JSON array of records at least len bytes long. */
+static char* make_json(unsigned long len, unsigned long *out_len)
+{
+    unsigned long cap = len + 256, off = 1, i;
+    char *doc = malloc(cap);
+
+    if (!doc)
+        return NULL;
+
+    doc[0] = '[';
+    for (i = 0; off < len; ++i) {
+        off += sprintf(doc + off,
+                "%s{\"id\":%lu,\"name\":\"item-%lu\",\"score\":%lu.5,"
+                "\"tags\":[\"a\",\"b\"],\"ok\":true,\"next\":null}",
+                i ? "," : "", i, i, i % 1000);
+    }
+    doc[off++] = ']';
+    doc[off] = '\0';
+
+    *out_len = off;
+    return doc;
+}
+
+static int setup_json(struct BenchCtx *ctx, unsigned long len)
+{
+    ctx->doc = make_json(len, &ctx->doc_len);
+    return ctx->doc ? 0 : -1;
+}
+
+static int setup_json_1k(struct BenchCtx *ctx)
+{
+    return setup_json(ctx, 1000);
+}
+
+static int setup_json_1m(struct BenchCtx *ctx)
+{
+    return setup_json(ctx, 1000000);
+}
+
+static int setup_json_100m(struct BenchCtx *ctx)
+{
+    return setup_json(ctx, 100000000);
+}
+
+/* Leave a parsed document as the last result for repr, serialize and
+   json-write. */
+static int setup_json_value(struct BenchCtx *ctx, unsigned long len)
+{
+    int ret;
+
+    if (setup_json(ctx, len))
+        return -1;
+
+    ret = sclisp_json_parse(ctx->s, ctx->doc, ctx->doc_len);
+    free(ctx->doc);
+    ctx->doc = NULL;
+
+    return ret == SCLISP_OK ? 0 : -1;
+}
+
+static int setup_value_1k(struct BenchCtx *ctx)
+{
+    return setup_json_value(ctx, 1000);
+}
+
+static int setup_value_1m(struct BenchCtx *ctx)
+{
+    return setup_json_value(ctx, 1000000);
+}
+
+/* Keep the serialized form of a parsed document for deserialize. */
+static int setup_serialized(struct BenchCtx *ctx, unsigned long len)
+{
+    void *data;
+
+    if (setup_json_value(ctx, len) ||
+            sclisp_serialize(ctx->s, &data, &ctx->doc_len) != SCLISP_OK)
+        return -1;
+
+    ctx->doc = data;
+    return 0;
+}
+
+static int setup_serialized_1k(struct BenchCtx *ctx)
+{
+    return setup_serialized(ctx, 1000);
+}
+
+static int setup_serialized_1m(struct BenchCtx *ctx)
+{
+    return setup_serialized(ctx, 1000000);
+}
+
+/* Leave the value of the expression as the last result, for round
+   trips of a value whose repr fits in the repr buffer. */
+static int setup_expr_value(struct BenchCtx *ctx)
+{
+    return run_eval(ctx);
+}
+
+static int setup_json_each(struct BenchCtx *ctx)
+{
+    if (sclisp_eval(ctx->s, "(set (ignore x) nil)") != SCLISP_OK)
+        return -1;
+
+    return setup_json_1m(ctx);
+}
+
+static int run_init_destroy(struct BenchCtx *ctx)
+{
+    struct sclisp *s;
+    int ret = sclisp_init(&s, &count_cb);
+
+    (void)ctx;
+
+    if (ret == SCLISP_OK)
+        sclisp_destroy(s);
+
+    return ret;
+}
+
+static int run_repr(struct BenchCtx *ctx)
+{
+    return sclisp_repr(ctx->s);
+}
+
+static int run_serialize(struct BenchCtx *ctx)
+{
+    void *data;
+    unsigned long len;
+    int ret = sclisp_serialize(ctx->s, &data, &len);
+
+    if (ret == SCLISP_OK)
+        count_cb.free_func(&count_cb, data);
+
+    return ret;
+}
+
+static int run_deserialize(struct BenchCtx *ctx)
+{
+    return sclisp_deserialize(ctx->s, ctx->doc, ctx->doc_len);
+}
+
+/* The text the repr of the last result would produce is the quoted
+   expression itself, so this measures passing a value as text. */
+static int run_repr_parse(struct BenchCtx *ctx)
+{
+    int ret = sclisp_repr(ctx->s);
+
+    return ret == SCLISP_OK ? sclisp_eval(ctx->s, ctx->expr) : ret;
+}
+
+static int run_serialize_round_trip(struct BenchCtx *ctx)
+{
+    void *data;
+    unsigned long len;
+    int ret = sclisp_serialize(ctx->s, &data, &len);
+
+    if (ret == SCLISP_OK) {
+        ret = sclisp_deserialize(ctx->s, data, len);
+        count_cb.free_func(&count_cb, data);
+    }
+
+    return ret;
+}
+
+static int run_json_parse(struct BenchCtx *ctx)
+{
+    return sclisp_json_parse(ctx->s, ctx->doc, ctx->doc_len);
+}
+
+static int run_json_write(struct BenchCtx *ctx)
+{
+    char *out;
+    int ret = sclisp_json_write(ctx->s, &out);
+
+    if (ret == SCLISP_OK)
+        count_cb.free_func(&count_cb, out);
+
+    return ret;
+}
+
+static int run_json_each(struct BenchCtx *ctx)
+{
+    return sclisp_json_each(ctx->s, ctx->doc, ctx->doc_len, "ignore");
+}
+
+#define PARSE_EXPR \
+    "(quote (define (tree-insert tree key value) " \
+        "(cond ((nil? tree) (list key value nil nil)) " \
+        "((< key (car tree)) (list (car tree) (cadr tree) " \
+        "(tree-insert (caddr tree) key value) (cadddr tree))) " \
+        "(#t (list (car tree) (cadr tree) (caddr tree) " \
+        "(tree-insert (cadddr tree) key value)))) " \
+        "\"a string literal\" 12345 -67.5 (nested (deeper (deepest))))))"
+
+static const struct Bench BENCHES[] = {
+    { "parse", NULL, run_eval, PARSE_EXPR, 0 },
+    { "lookup-scope-10", setup_scope_10, run_eval, "v0", 0 },
+    { "lookup-scope-100", setup_scope_100, run_eval, "v0", 0 },
+    { "lookup-scope-1000", setup_scope_1000, run_eval, "v0", 0 },
+    { "arith-expr", NULL, run_eval,
+        "(* (+ 3 5 7 11) (- 100 (/ 81 9) (mod 17 5)) (& 255 (| 3 (<< 1 4))))",
+        0 },
+    { "arith-loop-100", setup_functions, run_eval, "(sum-to 100 0)", 0 },
+    { "fib-15", setup_functions, run_eval, "(fib 15)", 0 },
+    { "list-build-200", setup_functions, run_eval, "(build nil 200)", 0 },
+    { "list-walk-200", setup_functions, run_eval, "(walk big 0)", 0 },
+    { "hash-list-200", setup_functions, run_eval, "(hash big)", 0 },
+    { "equal-list-200", setup_functions, run_eval, "(equal? big big2)", 0 },
+    { "helper-chain-100", setup_functions, run_eval, "(chain 100 0)", 0 },
+    { "call-builtin", NULL, run_eval, "(+ 1 2)", 0 },
+    { "call-lisp", setup_functions, run_eval, "(add 1 2)", 0 },
+    { "call-native", setup_functions, run_eval, "(native-add 1 2)", 0 },
+    { "init-destroy", NULL, run_init_destroy, NULL, 0 },
+    { "repr-1k", setup_value_1k, run_repr, NULL, 0 },
+    { "serialize-1k", setup_value_1k, run_serialize, NULL, 0 },
+    { "serialize-1m", setup_value_1m, run_serialize, NULL, 0 },
+    { "deserialize-1k", setup_serialized_1k, run_deserialize, NULL, 0 },
+    { "deserialize-1m", setup_serialized_1m, run_deserialize, NULL, 0 },
+    { "round-trip-repr", setup_expr_value, run_repr_parse, PARSE_EXPR, 0 },
+    { "round-trip-serialize", setup_expr_value, run_serialize_round_trip,
+        PARSE_EXPR, 0 },
+    { "json-parse-1k", setup_json_1k, run_json_parse, NULL, 0 },
+    { "json-parse-1m", setup_json_1m, run_json_parse, NULL, 0 },
+    { "json-parse-100m", setup_json_100m, run_json_parse, NULL, 1 },
+    { "json-write-1k", setup_value_1k, run_json_write, NULL, 0 },
+    { "json-write-1m", setup_value_1m, run_json_write, NULL, 0 },
+    { "json-each-1m", setup_json_each, run_json_each, NULL, 0 },
+    { NULL, NULL, NULL, NULL, 0 }
+};
+
+/***********************************************************************
+* Runner
+***********************************************************************/
+
+struct Result {
+    const char *name;
+    unsigned long iterations;
+    double ns_per_op;
+    double noise_pct;
+    double allocs_per_op;
+    double bytes_per_op;
+};
+
+static int run_batch(const struct Bench *b, struct BenchCtx *ctx,
+        unsigned long n, double *elapsed)
+{
+    unsigned long i;
+    double start = now_ns();
+
+    for (i = 0; i < n; ++i)
+        if (b->run(ctx) != SCLISP_OK)
+            return -1;
+
+    *elapsed = now_ns() - start;
+    return 0;
+}
+
+static int run_bench(const struct Bench *b, double min_time,
+        struct Result *res)
+{
+    struct BenchCtx ctx;
+    unsigned long n = 1;
+    double elapsed = 0, best, worst;
+    int i, ret = -1;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.expr = b->expr;
+
+    if (sclisp_init(&ctx.s, &count_cb) != SCLISP_OK)
+        return -1;
+
+    if (b->setup && b->setup(&ctx))
+        goto out;
+
+    /* Calibrate, which also warms up caches and the allocator. */
+    for (;;) {
+        if (run_batch(b, &ctx, n, &elapsed))
+            goto out;
+        if (elapsed >= min_time * 1e9 || n >= BENCH_MAX_BATCH)
+            break;
+        n *= 2;
+    }
+
+    best = worst = elapsed;
+    for (i = 0; i < BENCH_REPEAT; ++i) {
+        alloc_count.allocs = 0;
+        alloc_count.bytes = 0;
+
+        if (run_batch(b, &ctx, n, &elapsed))
+            goto out;
+        if (elapsed < best)
+            best = elapsed;
+        if (elapsed > worst)
+            worst = elapsed;
+    }
+
+    res->name = b->name;
+    res->iterations = n;
+    res->ns_per_op = best / n;
+    res->noise_pct = best > 0 ? (worst - best) * 100 / best : 0;
+    res->allocs_per_op = (double)alloc_count.allocs / n;
+    res->bytes_per_op = (double)alloc_count.bytes / n;
+    ret = 0;
+
+out:
+    if (ret)
+        fprintf(stderr, "%s: failed: %s\n", b->name, sclisp_errmsg(ctx.s)
+                ? sclisp_errmsg(ctx.s) : "setup error");
+    free(ctx.doc);
+    sclisp_destroy(ctx.s);
+    return ret;
+}
+
+static void write_results(FILE *f, const struct Result *results, int count)
+{
+    int i;
+
+    fprintf(f, "{\n  \"version\": \"%s\",\n  \"benchmarks\": [\n",
+            SCLISP_VERSION);
+    for (i = 0; i < count; ++i)
+        fprintf(f, "    {\"name\": \"%s\", \"iterations\": %lu, "
+                "\"ns_per_op\": %.1f, \"noise_pct\": %.1f, "
+                "\"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f}%s\n",
+                results[i].name, results[i].iterations,
+                results[i].ns_per_op, results[i].noise_pct,
+                results[i].allocs_per_op,
+                results[i].bytes_per_op, i + 1 < count ? "," : "");
+    fprintf(f, "  ]\n}\n");
+}
+
+/***********************************************************************
+* Baseline comparison
+***********************************************************************/
+
+static char* read_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    char *buf = NULL;
+    long len;
+
+    if (!f)
+        return NULL;
+
+    if (!fseek(f, 0, SEEK_END) && (len = ftell(f)) >= 0 &&
+            !fseek(f, 0, SEEK_SET) && (buf = malloc(len + 1))) {
+        if (fread(buf, 1, len, f) != (size_t)len) {
+            free(buf);
+            buf = NULL;
+        } else
+            buf[len] = '\0';
+    }
+
+    fclose(f);
+    return buf;
+}
+
+/* Find a numeric field of the named benchmark in a file written by
+   write_results. Returns -1 if the benchmark or field is missing. */
+static int baseline_field(const char *baseline, const char *name,
+        const char *field, double *out)
+{
+    char key[128];
+    const char *rec, *end, *val;
+
+    sprintf(key, "\"name\": \"%.100s\"", name);
+    if (!(rec = strstr(baseline, key)))
+        return -1;
+
+    end = strchr(rec, '}');
+    sprintf(key, "\"%.100s\": ", field);
+    val = strstr(rec, key);
+    if (!val || (end && val > end))
+        return -1;
+
+    *out = strtod(val + strlen(key), NULL);
+    return 0;
+}
+
+/* A negative threshold only reports timings. */
+static int compare_results(const char *baseline,
+        const struct Result *results, int count, double threshold)
+{
+    int i, regressions = 0;
+
+    fprintf(stderr, "%-20s %14s %14s %9s %7s %12s %12s\n", "benchmark",
+            "ns/op", "baseline", "delta", "noise", "allocs/op", "baseline");
+
+    for (i = 0; i < count; ++i) {
+        const struct Result *r = &results[i];
+        double ns, allocs, delta, noise = 0;
+        const char *flag = "";
+
+        if (baseline_field(baseline, r->name, "ns_per_op", &ns) ||
+                baseline_field(baseline, r->name, "allocs_per_op",
+                    &allocs)) {
+            fprintf(stderr, "%-20s %14.1f %14s\n", r->name, r->ns_per_op,
+                    "(new)");
+            continue;
+        }
+
+        delta = ns > 0 ? (r->ns_per_op - ns) * 100 / ns : 0;
+
+        /* Older baselines carry no noise estimate. */
+        if (baseline_field(baseline, r->name, "noise_pct", &noise))
+            noise = 0;
+        if (r->noise_pct > noise)
+            noise = r->noise_pct;
+
+        /* Allocation counts are deterministic, so any real increase is
+           reported, while timings must also clear the noise seen while
+           measuring either side. */
+        if ((threshold >= 0 && delta > threshold + noise) ||
+                r->allocs_per_op > allocs * (1 + ALLOC_TOLERANCE) + 0.005) {
+            flag = "  REGRESSION";
+            ++regressions;
+        }
+
+        fprintf(stderr,
+                "%-20s %14.1f %14.1f %+8.1f%% %6.1f%% %12.2f %12.2f%s\n",
+                r->name, r->ns_per_op, ns, delta, noise, r->allocs_per_op,
+                allocs, flag);
+    }
+
+    if (regressions && threshold >= 0)
+        fprintf(stderr, "%d regression(s) over %.1f%% plus noise or in "
+                "allocations\n", regressions, threshold);
+    else if (regressions)
+        fprintf(stderr, "%d allocation regression(s)\n", regressions);
+
+    return regressions;
+}
+
+/***********************************************************************
+* Main
+***********************************************************************/
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [--filter SUBSTR] [--min-time SECONDS] [--large]\n"
+            "       [--output FILE] [--baseline FILE] [--threshold PCT]\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = NULL, *output = NULL, *baseline_path = NULL;
+    double min_time = 0.2, threshold = -1;
+    int large = 0, count = 0, failed = 0, i;
+    struct Result results[sizeof(BENCHES) / sizeof(BENCHES[0])];
+    const struct Bench *b;
+    FILE *out = stdout;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--large"))
+            large = 1;
+        else if (i + 1 < argc && !strcmp(argv[i], "--filter"))
+            filter = argv[++i];
+        else if (i + 1 < argc && !strcmp(argv[i], "--min-time"))
+            min_time = atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--output"))
+            output = argv[++i];
+        else if (i + 1 < argc && !strcmp(argv[i], "--baseline"))
+            baseline_path = argv[++i];
+        else if (i + 1 < argc && !strcmp(argv[i], "--threshold"))
+            threshold = atof(argv[++i]);
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    for (b = BENCHES; b->name; ++b) {
+        if (b->large && !large)
+            continue;
+        if (filter && !strstr(b->name, filter))
+            continue;
+
+        fprintf(stderr, "running %s...\n", b->name);
+        if (run_bench(b, min_time, &results[count]))
+            ++failed;
+        else
+            ++count;
+    }
+
+    if (output && !(out = fopen(output, "w"))) {
+        perror(output);
+        return 1;
+    }
+
+    write_results(out, results, count);
+    if (out != stdout)
+        fclose(out);
+
+    if (baseline_path) {
+        char *baseline = read_file(baseline_path);
+
+        if (!baseline) {
+            perror(baseline_path);
+            return 1;
+        }
+
+        if (compare_results(baseline, results, count, threshold))
+            failed = 1;
+        free(baseline);
+    }
+
+    return failed ? 1 : 0;
+}
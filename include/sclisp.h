@@ -56,12 +56,262 @@ extern const unsigned long SCLISP_VERSION_NUMBER;
 int sclisp_init(struct sclisp **s, struct sclisp_cb *cb);
 void sclisp_destroy(struct sclisp *s);
 int sclisp_eval(struct sclisp *s, const char *exp);
+int sclisp_load_file(struct sclisp *s, const char *path);
+
+int sclisp_add_import_path(struct sclisp *s, const char *dir);
+int sclisp_set_import_cache(struct sclisp *s, const char *dir);
+int sclisp_import(struct sclisp *s, const char *name);
+
+int sclisp_save_image(struct sclisp *s, const char *path);
+int sclisp_load_image(struct sclisp *s, const char *path);
 
 const char* sclisp_errstr(int errcode);
 const char* sclisp_errmsg(struct sclisp *s);
 
+/* Counters are maintained unconditionally. live_objects is a gauge and
+   is not cleared by sclisp_reset_stats; everything else counts from
+   the last reset. */
+struct sclisp_stats {
+    unsigned long evals;            /* top level forms evaluated */
+    unsigned long internal_evals;   /* evaluator entries */
+    unsigned long function_calls;   /* lisp functions and lambdas */
+    unsigned long builtin_calls;    /* builtins and user funcs */
+    unsigned long cells;            /* allocations by type */
+    unsigned long integers;
+    unsigned long reals;
+    unsigned long strings;
+    unsigned long symbols;
+    unsigned long functions;
+    unsigned long builtins;
+    unsigned long scope_lookups;
+    unsigned long scope_links;      /* scopes walked by lookups */
+    unsigned long live_objects;
+    unsigned long peak_depth;       /* deepest evaluator recursion */
+    unsigned long errors[SCLISP_OVERFLOW + 1];  /* by error code */
+    unsigned long bugs;             /* SCLISP_BUG reports */
+    unsigned long node_rewrites;    /* call sites specialized */
+    unsigned long node_deopts;      /* specialized sites made generic */
+    unsigned long jit_compiles;     /* functions compiled */
+    unsigned long jit_calls;        /* calls run as native code */
+    unsigned long jit_bailouts;     /* native calls finished by eval */
+    unsigned long jit_invalidations;
+    unsigned long node_folds;       /* calls computed ahead of time */
+    unsigned long node_inlines;     /* lambda calls inlined */
+    unsigned long memo_hits;        /* memoized calls answered */
+    unsigned long memo_misses;
+};
+
+int sclisp_get_stats(struct sclisp *s, struct sclisp_stats *out);
+int sclisp_reset_stats(struct sclisp *s);
+
+/* Times are in the units of the clock passed to sclisp_profile_start,
+   or seconds of processor time if none was given. Lambdas are named
+   after the symbol they are bound to. Report names remain valid until
+   the next sclisp_profile_reset. */
+struct sclisp_profile_entry {
+    const char *name;
+    unsigned long calls;
+    double inclusive;
+    double exclusive;
+};
+
+int sclisp_profile_start(struct sclisp *s, double (*clock)(void *user),
+        void *user);
+int sclisp_profile_stop(struct sclisp *s);
+int sclisp_profile_reset(struct sclisp *s);
+int sclisp_profile_report(struct sclisp *s,
+        struct sclisp_profile_entry **out, unsigned long *count);
+int sclisp_profile_print(struct sclisp *s);
+
+/* Sample the call stack every `every` evaluation steps (0 to sample only
+   on request) into a buffer of `capacity` frames (0 for a default).
+   sclisp_sample_request is async-signal-safe, so it may be called from
+   a SIGPROF handler; the sample is taken at the next evaluation step.
+   sclisp_sample_folded writes the samples in folded-stack format, for
+   flame graph tools, to a buffer the caller frees. */
+int sclisp_sample_start(struct sclisp *s, unsigned long every,
+        unsigned long capacity);
+int sclisp_sample_stop(struct sclisp *s);
+int sclisp_sample_request(struct sclisp *s);
+int sclisp_sample_reset(struct sclisp *s);
+int sclisp_sample_folded(struct sclisp *s, char **out);
+
+#define SCLISP_TRACE_ENTER  0
+#define SCLISP_TRACE_EXIT   1
+
+/* A call to a lisp function, builtin or user func. id identifies the
+   function for as long as it exists. err is the error code pending at
+   the time of the event, so an exit with a non-zero err failed. time
+   comes from the ring buffer clock and is 0 for hooks. */
+struct sclisp_trace_event {
+    const char *name;
+    const void *id;
+    unsigned long depth;
+    unsigned long argc;
+    double time;
+    int kind;
+    int err;
+};
+
+/* Hooks are called synchronously around every call and must not use
+   the instance. Pass NULL hooks to remove them. */
+int sclisp_trace_hooks(struct sclisp *s,
+        void (*enter)(const struct sclisp_trace_event *ev, void *user),
+        void (*exit)(const struct sclisp_trace_event *ev, void *user),
+        void *user);
+
+/* Record events into a ring buffer of `capacity` events (0 to disable)
+   without calling back into the host; when full the oldest events are
+   overwritten and counted as lost. sclisp_trace_read drains up to max
+   events, oldest first. Names read stay valid until the next read or
+   evaluation. */
+int sclisp_trace_ring(struct sclisp *s, unsigned long capacity,
+        double (*clock)(void *user), void *user);
+int sclisp_trace_read(struct sclisp *s, struct sclisp_trace_event *out,
+        unsigned long max, unsigned long *count, unsigned long *lost);
+
+/* Log-linear latency histograms. Values below 32 are counted exactly;
+   above that each power of two is split into 16 buckets, bounding the
+   error of any reported value to about 6%. Histograms are plain data,
+   so a host may copy them out of several instances or threads and
+   merge them. Percentiles report the upper bound of the bucket holding
+   the requested rank, clamped to the largest recorded value. */
+#define SCLISP_HIST_BUCKETS (32 + 16 * (sizeof(unsigned long) * 8 - 5))
+
+struct sclisp_histogram {
+    unsigned long counts[SCLISP_HIST_BUCKETS];
+    unsigned long count;
+    unsigned long min;
+    unsigned long max;
+};
+
+int sclisp_hist_reset(struct sclisp_histogram *h);
+int sclisp_hist_record(struct sclisp_histogram *h, unsigned long value);
+int sclisp_hist_merge(struct sclisp_histogram *dst,
+        const struct sclisp_histogram *src);
+unsigned long sclisp_hist_percentile(const struct sclisp_histogram *h,
+        double percentile);
+
+/* Record the latency of every sclisp_eval and of every call to each
+   registered user function, in ticks of clock (nanoseconds of
+   processor time if NULL). */
+int sclisp_latency_start(struct sclisp *s,
+        unsigned long (*clock)(void *user), void *user);
+int sclisp_latency_stop(struct sclisp *s);
+int sclisp_latency_reset(struct sclisp *s);
+int sclisp_latency_eval(struct sclisp *s, struct sclisp_histogram *out);
+int sclisp_latency_func(struct sclisp *s, const char *name,
+        struct sclisp_histogram *out);
+
+/* Heap census: live objects and the bytes they own, by type. */
+#define SCLISP_CENSUS_INTEGER   0
+#define SCLISP_CENSUS_REAL      1
+#define SCLISP_CENSUS_STRING    2
+#define SCLISP_CENSUS_SYMBOL    3
+#define SCLISP_CENSUS_FUNCTION  4
+#define SCLISP_CENSUS_BUILTIN   5
+#define SCLISP_CENSUS_CELL      6
+#define SCLISP_CENSUS_TYPES     7
+
+struct sclisp_census {
+    unsigned long objects[SCLISP_CENSUS_TYPES];
+    unsigned long bytes[SCLISP_CENSUS_TYPES];
+};
+
+int sclisp_heap_census(struct sclisp *s, struct sclisp_census *out);
+
+/* Allocation sites attribute objects to the builtin or function being
+   called when they were made ("<parse>" for the reader, "<toplevel>"
+   outside of any call). Names remain valid until the instance is
+   destroyed; the array returned by sclisp_alloc_sites is sorted by
+   live bytes and must be released with the instance's free_func. */
+struct sclisp_alloc_site {
+    const char *name;
+    unsigned long allocs;
+    unsigned long objects;
+    unsigned long bytes;
+};
+
+int sclisp_alloc_sites_start(struct sclisp *s);
+int sclisp_alloc_sites_stop(struct sclisp *s);
+int sclisp_alloc_sites_reset(struct sclisp *s);
+int sclisp_alloc_sites(struct sclisp *s, struct sclisp_alloc_site **out,
+        unsigned long *count);
+
+/* Write every object reachable from the scopes and the last result to
+   path, one record per line:
+       root <scope> <symbol> <id>   (scope 0 is the global scope)
+       result <id>
+       object <id> <type> <refs> <bytes> <site> <value>
+       edge <from> <to> car|cdr|args|body */
+int sclisp_heap_dump(struct sclisp *s, const char *path);
+
+/* Call sites specialize themselves on the types they see: binary
+   arithmetic and comparisons on two integers or two reals are computed
+   inline, and calls that always reach the same lambda bind its
+   parameters directly. Inside function bodies, calls to small
+   non-recursive lambdas are replaced by their body when the code is
+   read, until either name is rebound. Enabled by default; a site that
+   sees anything else falls back to generic evaluation for good. */
+int sclisp_set_specialize(struct sclisp *s, int enable);
+
+/* While specialization is enabled, calls to arithmetic, comparison,
+   bitwise and type predicate builtins whose arguments are all constant
+   are computed once when code is read, for as long as those names keep
+   their global bindings. Constants are literals, #t, #f and global
+   symbols marked here, which must be bound; they cannot be set again
+   until unmarked. Only callable at top level. */
+int sclisp_mark_constant(struct sclisp *s, const char *sym, int constant);
+
+/* Bind name to a version of the function bound to func with some of
+   its parameters fixed. fixed is a list of (parameter expression),
+   e.g. "((rate 3) (base (* 60 60)))"; the expressions are evaluated
+   now and the result takes the remaining parameters in order. */
+int sclisp_specialize(struct sclisp *s, const char *name, const char *func,
+        const char *fixed);
+
+/* (memoize f [capacity]) returns a version of the lambda f that caches
+   up to capacity results (256 by default), keyed on the values of its
+   arguments and evicting the least recently used. Only useful for
+   functions whose result depends on nothing else. Memoized functions
+   cannot be saved in images. These report on and empty the cache of a
+   memoized function bound globally to name; the counters are kept
+   across sclisp_memo_clear. (memo-clear f) empties a cache from lisp. */
+struct sclisp_memo_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long entries;
+    unsigned long capacity;
+};
+
+int sclisp_memo_stats(struct sclisp *s, const char *name,
+        struct sclisp_memo_stats *out);
+int sclisp_memo_clear(struct sclisp *s, const char *name);
+
+/* Functions whose body is a single arithmetic, comparison or cond
+   expression over their parameters are compiled to native code once
+   called `calls` times (100 by default, 0 disables the JIT). Compiled
+   code is bypassed while profiling, sampling, tracing or tracking
+   allocation sites. With the perf map enabled, compiled functions are
+   appended to /tmp/perf-<pid>.map. Both return SCLISP_UNSUPPORTED if
+   the library was built without the JIT. */
+int sclisp_jit_set_threshold(struct sclisp *s, unsigned long calls);
+int sclisp_jit_perf_map(struct sclisp *s, int enable);
+
 /* TODO: Experimental API. Stabilize. */
 
+#define SCLISP_NUMBER_NIL       0
+#define SCLISP_NUMBER_INTEGER   1
+#define SCLISP_NUMBER_REAL      2
+
+/* A numeric argument or result of a user function. nil is accepted and
+   produced as is; arithmetic treats it as 0. */
+struct sclisp_number {
+    int type;
+    long i;
+    double r;
+};
+
 struct sclisp_func_api {
     int (*arg_integer)(const struct sclisp_func_api *api, unsigned index,
             long *out);
@@ -74,6 +324,11 @@ struct sclisp_func_api {
     int (*return_string)(const struct sclisp_func_api *api, char *ret);
     struct sclisp_cb *cb;
     void *inst;
+    /* Unlike arg_integer and arg_real, these keep the argument's type. */
+    int (*arg_number)(const struct sclisp_func_api *api, unsigned index,
+            struct sclisp_number *out);
+    int (*return_number)(const struct sclisp_func_api *api,
+            const struct sclisp_number *ret);
 };
 
 struct sclisp_scope_api {
@@ -100,6 +355,17 @@ int sclisp_register_user_func(struct sclisp *s,
 const struct sclisp_scope_api* sclisp_get_scope_api(struct sclisp *s);
 
 int sclisp_repr(struct sclisp *s);
+int sclisp_serialize(struct sclisp *s, void **out, unsigned long *len);
+int sclisp_deserialize(struct sclisp *s, const void *data, unsigned long len);
+int sclisp_json_parse(struct sclisp *s, const char *json, unsigned long len);
+int sclisp_json_write(struct sclisp *s, char **out);
+int sclisp_json_each(struct sclisp *s, const char *json, unsigned long len,
+        const char *func);
+
+/* Hash of the last result, equal for values that equal? considers
+   equal. Hashes are 32 bits and, for values holding functions or
+   builtins, only stable for the life of those objects. */
+int sclisp_hash(struct sclisp *s, unsigned long *out);
 
 #ifdef __cplusplus
 }
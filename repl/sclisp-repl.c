@@ -17,29 +17,112 @@
 * 02110-1301, USA.
 ***********************************************************************/
 
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <readline/history.h>
 #include <readline/readline.h>
 
 #include "sclisp.h"
 
+/* Allocations are counted so that :alloc can report them. */
+struct AllocCount {
+    unsigned long allocs;
+    unsigned long bytes;
+    unsigned long frees;
+};
+
+static void* count_alloc_func(struct sclisp_cb *cb, unsigned long sz)
+{
+    struct AllocCount *count = cb->user;
+
+    ++count->allocs;
+    count->bytes += sz;
+
+    return malloc(sz);
+}
+
+static void* count_zalloc_func(struct sclisp_cb *cb, unsigned long sz)
+{
+    struct AllocCount *count = cb->user;
+
+    ++count->allocs;
+    count->bytes += sz;
+
+    return calloc(1, sz);
+}
+
+static void count_free_func(struct sclisp_cb *cb, void *mem)
+{
+    struct AllocCount *count = cb->user;
+
+    if (mem)
+        ++count->frees;
+    free(mem);
+}
+
+static void print_func(struct sclisp_cb *cb, int fd, const char *str)
+{
+    (void)cb;
+    fputs(str, fd == SCLISP_STDOUT ? stdout : stderr);
+}
+
+static char getchar_func(struct sclisp_cb *cb)
+{
+    (void)cb;
+    return getchar();
+}
+
+static struct AllocCount alloc_count;
+
+static struct sclisp_cb repl_cb = {
+    count_alloc_func,
+    count_zalloc_func,
+    count_free_func,
+    print_func,
+    getchar_func,
+    &alloc_count
+};
+
+static double now_ns(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+#else
+    return clock() * (1e9 / CLOCKS_PER_SEC);
+#endif
+}
+
+/* Input is complete once every paren outside of a string literal is
+   closed. Meta-commands may span lines the same way as expressions;
+   a line with surplus closing parens is submitted so that the
+   interpreter can report it rather than waiting forever. */
 static int paren_balence_cr(int count, int key)
 {
     char *buf = rl_line_buffer;
-    int pcount = 0;
+    int pcount = 0, in_string = 0;
 
     (void)count;
     (void)key;
 
     while (*buf) {
-        if (*buf == '(') ++pcount;
-        else if  (*buf == ')') --pcount;
+        if (*buf == '"') in_string = !in_string;
+        else if (!in_string && *buf == '(') ++pcount;
+        else if (!in_string && *buf == ')') --pcount;
         ++buf;
     }
 
-    if (!pcount) {
+    if (pcount <= 0) {
         rl_done = 1;
         printf("\n");
     } else
@@ -60,6 +143,169 @@ static int startup_hook(void)
     return 0;
 }
 
+static void print_error(struct sclisp *s, int res)
+{
+    const char* errstr = sclisp_errstr(res);
+    const char* errmsg = sclisp_errmsg(s);
+
+    printf("ERROR (%s): %s\n", errstr ? errstr : "",
+            errmsg ? errmsg : "");
+}
+
+/* Returns the text following the command word if input starts with
+   it, or NULL. */
+static const char* command_arg(const char *input, const char *command)
+{
+    unsigned long len = strlen(command);
+
+    if (strncmp(input, command, len) ||
+            (input[len] && !isspace((unsigned char)input[len])))
+        return NULL;
+
+    for (input += len; isspace((unsigned char)*input); ++input)
+        ;
+
+    return input;
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+static void print_ns(const char *label, double ns)
+{
+    if (ns >= 1e9)
+        printf("%s %.3f s", label, ns / 1e9);
+    else if (ns >= 1e6)
+        printf("%s %.3f ms", label, ns / 1e6);
+    else if (ns >= 1e3)
+        printf("%s %.3f us", label, ns / 1e3);
+    else
+        printf("%s %.0f ns", label, ns);
+}
+
+static void command_time(struct sclisp *s, const char *arg)
+{
+    unsigned long n, i;
+    double *times;
+    char *expr;
+    int res = 0;
+
+    n = strtoul(arg, &expr, 10);
+    while (isspace((unsigned char)*expr))
+        ++expr;
+
+    if (!n || expr == arg || !*expr) {
+        printf("Usage: :time N expr\n");
+        return;
+    }
+
+    if (!(times = malloc(n * sizeof(*times)))) {
+        printf("Too many iterations.\n");
+        return;
+    }
+
+    for (i = 0; i < n && !res; ++i) {
+        double start = now_ns();
+
+        res = sclisp_eval(s, expr);
+        times[i] = now_ns() - start;
+    }
+
+    if (res)
+        print_error(s, res);
+    else {
+        qsort(times, n, sizeof(*times), double_cmp);
+        printf("%lu runs:", n);
+        print_ns(" min", times[0]);
+        print_ns(", median", times[n / 2]);
+        print_ns(", p99", times[(n * 99 + 99) / 100 - 1]);
+        printf("\n");
+    }
+
+    free(times);
+}
+
+static void command_alloc(struct sclisp *s, const char *expr)
+{
+    struct sclisp_census before, after;
+    struct AllocCount start = alloc_count;
+    long objects = 0, bytes = 0;
+    int res, i;
+
+    if (!*expr) {
+        printf("Usage: :alloc expr\n");
+        return;
+    }
+
+    sclisp_heap_census(s, &before);
+    if ((res = sclisp_eval(s, expr)))
+        print_error(s, res);
+    sclisp_heap_census(s, &after);
+
+    for (i = 0; i < SCLISP_CENSUS_TYPES; ++i) {
+        objects += (long)(after.objects[i] - before.objects[i]);
+        bytes += (long)(after.bytes[i] - before.bytes[i]);
+    }
+
+    printf("%lu allocs, %lu bytes, %lu frees; %ld objects (%ld bytes) "
+            "retained\n", alloc_count.allocs - start.allocs,
+            alloc_count.bytes - start.bytes,
+            alloc_count.frees - start.frees, objects, bytes);
+}
+
+/* Profiles a single expression. Any profile being collected with
+   :profile on is discarded. */
+static void command_profile(struct sclisp *s, const char *expr)
+{
+    int res;
+
+    sclisp_profile_stop(s);
+    sclisp_profile_reset(s);
+    sclisp_profile_start(s, NULL, NULL);
+    if ((res = sclisp_eval(s, expr)))
+        print_error(s, res);
+    sclisp_profile_stop(s);
+    sclisp_profile_print(s);
+    sclisp_profile_reset(s);
+}
+
+/* Meta-commands start with a colon and are not passed to the
+   interpreter. Returns non-zero if input was a meta-command. */
+static int repl_command(struct sclisp *s, const char *input)
+{
+    const char *arg;
+
+    if (*input != ':')
+        return 0;
+
+    if ((arg = command_arg(input, ":time")))
+        command_time(s, arg);
+    else if ((arg = command_arg(input, ":alloc")))
+        command_alloc(s, arg);
+    else if (!strcmp(input, ":profile on"))
+        sclisp_profile_start(s, NULL, NULL);
+    else if (!strcmp(input, ":profile off"))
+        sclisp_profile_stop(s);
+    else if (!strcmp(input, ":profile reset"))
+        sclisp_profile_reset(s);
+    else if (!strcmp(input, ":profile"))
+        sclisp_profile_print(s);
+    else if ((arg = command_arg(input, ":profile")))
+        command_profile(s, arg);
+    else
+        printf("Unknown command. Available commands:\n"
+                "    :time N expr             min/median/p99 of N runs\n"
+                "    :alloc expr              allocations made by expr\n"
+                "    :profile expr            per-function profile of expr\n"
+                "    :profile [on|off|reset]  per-function profile\n");
+
+    return 1;
+}
+
 int main(void)
 {
     struct sclisp *s;
@@ -69,7 +315,7 @@ int main(void)
             SCLISP_VERSION_NUMBER);
 
     rl_startup_hook = startup_hook;
-    sclisp_init(&s, NULL);
+    sclisp_init(&s, &repl_cb);
 
     while (1) {
         char* input = readline("sclisp> ");
@@ -81,13 +327,14 @@ int main(void)
         if (strlen(input) > 0)
             add_history(input);
 
-        res = sclisp_eval(s, input);
-        if (res) {
-            const char* errstr = sclisp_errstr(res);
-            const char* errmsg = sclisp_errmsg(s);
-            printf("ERROR (%s): %s\n", errstr ? errstr : "",
-                    errmsg ? errmsg : "");
+        if (repl_command(s, input)) {
+            free(input);
+            continue;
         }
+
+        res = sclisp_eval(s, input);
+        if (res)
+            print_error(s, res);
         sclisp_repr(s);
 
         free(input);
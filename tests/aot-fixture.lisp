@@ -0,0 +1,26 @@
+; Compiled by sclisp-aot for the external tests, which compare each
+; function against the same file loaded by the interpreter.
+
+(set (fib n)
+    (cond ((< n 2) n)
+          (#t (+ (fib (- n 1)) (fib (- n 2))))))
+
+(set (poly x y) (+ (* 3 x x) (- y) (/ x 2) (mod y 7)))
+(set square (lambda (x) (* x x)))
+(set (hyp a b) (+ (square a) (square b)))
+(set (safe-div a b) (cond ((== b 0) nil) (#t (/ a b))))
+(set (sign x) (cond ((< x 0) -1) ((> x 0) 1)))
+(set (is-small? x) (cond ((< x 10))))
+(set (one) (-))
+(set (ignore x))
+(set (both a b) (/ a b) (* b 2))
+(set (rem a b) (mod a b))
+(set (inv x) (/ x))
+(set (limits) (- -0x7fffffffffffffff 1 2.5e-3))
+
+; These stay interpreted.
+(set base 10)
+(set (scaled x) (* x base))
+(set (twice x) (scaled (scaled x)))
+(set (greet name) (cons "hello" name))
+(set label "a string; not a comment (or a list")
@@ -24,6 +24,7 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "sclisp-test.h"
 #include "sclisp.h"
@@ -93,6 +94,501 @@ static int add_two(const struct sclisp_func_api *api, void *user)
     return SCLISP_OK;
 }
 
+static void test_load_file(struct sclisp *s)
+{
+    const char *path = "sclisp-test-load.lisp";
+    const struct sclisp_scope_api *api;
+    FILE *f = fopen(path, "w");
+    char *str;
+    int i;
+
+    if (!f) {
+        printf("load: could not create %s\n", path);
+        return;
+    }
+
+    fputs("; Leading comment.\n"
+          "(set (square x) (* x x)) ; Trailing comment.\n"
+          "(set long-str \"", f);
+    for (i = 0; i < 40; ++i)
+        fputs("long ", f);
+    fputs("\")\n"
+          "'(a b c)\n"
+          "(square 12)\n", f);
+    fclose(f);
+
+    printf("load: %d\n", sclisp_load_file(s, path));
+    sclisp_repr(s);
+    api = sclisp_get_scope_api(s);
+    if (!api->get_string(api, "long-str", &str)) {
+        printf("long-str length: %lu\n", (unsigned long)strlen(str));
+        api->cb->free_func(api->cb, str);
+    }
+    sclisp_eval(s, "(load \"sclisp-test-load.lisp\")");
+    sclisp_repr(s);
+    printf("load missing: %d\n",
+            sclisp_load_file(s, "sclisp-test-missing.lisp"));
+
+    remove(path);
+}
+
+static void test_import(void)
+{
+    const char *path = "sclisp-test-mod.lisp";
+    const char *src = "; Test module.\n"
+                      "(set (mod-double x) (* 2 x))\n"
+                      "(set mod-count (+ mod-count 1))\n";
+    const unsigned char *p = (const unsigned char *)src;
+    unsigned long hash = 2166136261UL;
+    char cache[64];
+    struct sclisp *s;
+    FILE *f = fopen(path, "w");
+    int i;
+
+    if (!f) {
+        printf("import: could not create %s\n", path);
+        return;
+    }
+    fputs(src, f);
+    fclose(f);
+
+    /* The cache file is named after the FNV-1a hash and length of the
+       module source. */
+    while (*p) {
+        hash ^= *p++;
+        hash = (hash * 16777619UL) & 0xffffffffUL;
+    }
+    sprintf(cache, "./%08lx-%lx.sclc", hash, (unsigned long)strlen(src));
+
+    /* Once cold and once warm from the cache written by the first. */
+    for (i = 0; i < 2; ++i) {
+        sclisp_init(&s, NULL);
+        sclisp_add_import_path(s, "/nonexistent");
+        sclisp_add_import_path(s, ".");
+        sclisp_set_import_cache(s, ".");
+        sclisp_eval(s, "(set mod-count 0)");
+
+        printf("import %d: %d\n", i, sclisp_import(s, "sclisp-test-mod"));
+        sclisp_repr(s);
+        sclisp_eval(s, "(import \"sclisp-test-mod\")");
+        sclisp_repr(s);
+        sclisp_eval(s, "(mod-double mod-count)");
+        sclisp_repr(s);
+
+        if ((f = fopen(cache, "rb")))
+            fclose(f);
+        printf("cache exists: %d\n", !!f);
+
+        if (i)
+            printf("import missing: %d\n", sclisp_import(s, "no-such-mod"));
+
+        sclisp_destroy(s);
+    }
+
+    remove(cache);
+    remove(path);
+}
+
+static void test_image(void)
+{
+    const char *path = "sclisp-test.image";
+    struct sclisp *s;
+
+    sclisp_init(&s, NULL);
+    sclisp_register_user_func(s, add_two, "add2", NULL, NULL);
+    sclisp_eval(s, "(set (fact n) (cond ((< n 2) 1) (#t (* n (fact (- n 1))))))");
+    sclisp_eval(s, "(set shared '(1 2.5 \"three\" four))");
+    sclisp_eval(s, "(set pair (list shared shared))");
+    sclisp_eval(s, "(set plus +)");
+    sclisp_eval(s, "(set adder add2)");
+    printf("save image: %d\n", sclisp_save_image(s, path));
+    sclisp_destroy(s);
+
+    sclisp_init(&s, NULL);
+    sclisp_register_user_func(s, add_two, "add2", NULL, NULL);
+    printf("load image: %d\n", sclisp_load_image(s, path));
+    sclisp_eval(s, "(fact 10)");
+    sclisp_repr(s);
+    sclisp_eval(s, "pair");
+    sclisp_repr(s);
+    sclisp_eval(s, "(plus 1 2)");
+    sclisp_repr(s);
+    sclisp_eval(s, "(adder 1 2.5)");
+    sclisp_repr(s);
+    sclisp_destroy(s);
+
+    /* Host functions the image refers to must be registered first. */
+    sclisp_init(&s, NULL);
+    printf("load unlinked image: %d\n", sclisp_load_image(s, path));
+    sclisp_destroy(s);
+
+    remove(path);
+}
+
+static unsigned long fuzz_rand(unsigned long *state)
+{
+    *state = (*state * 1103515245UL + 12345UL) & 0x7fffffffUL;
+    return *state >> 8;
+}
+
+static void test_serialize(void)
+{
+    const struct sclisp_scope_api *api;
+    struct sclisp *s;
+    unsigned char *data, *mut;
+    unsigned long len = 0, state = 42, i, j;
+    void *out = NULL;
+    int ok = 0;
+
+    sclisp_init(&s, NULL);
+    sclisp_eval(s, "(set shared '(x \"y\" 3.25))");
+    sclisp_eval(s, "(list -1 0 9223372036854775807 shared shared "
+            "'(a . b) (lambda (x) (+ x 1)) car nil \"\")");
+    printf("serialize: %d\n", sclisp_serialize(s, &out, &len));
+    data = out;
+    printf("deserialize: %d\n", sclisp_deserialize(s, data, len));
+    sclisp_repr(s);
+
+    sclisp_eval(s, "(deserialize (serialize '(1 (2 (3)) \"four\")))");
+    sclisp_repr(s);
+    printf("deserialize junk: %d\n",
+            sclisp_eval(s, "(deserialize \"not base64!\")"));
+
+    /* Mutated and truncated input must be rejected or decoded, but
+       never crash or leak. */
+    mut = malloc(len);
+    for (i = 0; i < 20000; ++i) {
+        unsigned long mlen = len;
+
+        memcpy(mut, data, len);
+        for (j = fuzz_rand(&state) % 4 + 1; j; --j)
+            mut[fuzz_rand(&state) % len] = fuzz_rand(&state) & 0xff;
+        if (fuzz_rand(&state) % 4 == 0)
+            mlen = fuzz_rand(&state) % len;
+
+        ok += !sclisp_deserialize(s, mut, mlen);
+    }
+    printf("fuzz: %d accepted\n", ok > 0);
+    free(mut);
+
+    api = sclisp_get_scope_api(s);
+    api->cb->free_func(api->cb, data);
+    sclisp_destroy(s);
+}
+
+static void test_json(void)
+{
+    const char *doc = "{\"id\": 42, \"score\": -1.5e2, \"ok\": true,\n"
+                      " \"tags\": [\"a\", \"b\\n\\u00e9\\ud83d\\ude00\"],"
+                      " \"none\": null, \"big\": 123456789012345678901234}";
+    const char *rows = "[1, 2, 3, 4, 5]";
+    const char *bad[] = { "[1, 2", "{\"a\" 1}", "tru", "\"\\u0000\"",
+                          "[1] x", NULL };
+    const struct sclisp_scope_api *api;
+    struct sclisp *s;
+    char *out = NULL;
+    int i;
+
+    sclisp_init(&s, NULL);
+    api = sclisp_get_scope_api(s);
+
+    printf("json-parse: %d\n", sclisp_json_parse(s, doc, strlen(doc)));
+    sclisp_repr(s);
+    printf("json-write: %d\n", sclisp_json_write(s, &out));
+    printf("%s\n", out ? out : "");
+    api->cb->free_func(api->cb, out);
+
+    sclisp_eval(s, "(set (double-row r) (* 2 r))");
+    printf("json-each: %d\n", sclisp_json_each(s, rows, strlen(rows),
+                "double-row"));
+    sclisp_repr(s);
+    sclisp_eval(s, "(json-each \"[[1, 2], [3]]\" car)");
+    sclisp_repr(s);
+    sclisp_eval(s, "(json-write (json-parse \"[1, 2.0, false, [], {}]\"))");
+    sclisp_repr(s);
+
+    for (i = 0; bad[i]; ++i)
+        printf("json bad %d: %d\n", i,
+                sclisp_json_parse(s, bad[i], strlen(bad[i])));
+
+    sclisp_destroy(s);
+}
+
+static void test_stats(void)
+{
+    struct sclisp *s = NULL;
+    struct sclisp_stats st;
+    unsigned long live;
+
+    if (sclisp_init(&s, NULL)) {
+        printf("stats: sclisp_init failed\n");
+        return;
+    }
+
+    sclisp_eval(s, "(set (fib n) (cond ((< n 2) n) "
+            "(#t (+ (fib (- n 1)) (fib (- n 2))))))");
+    sclisp_get_stats(s, &st);
+    live = st.live_objects;
+
+    sclisp_reset_stats(s);
+    sclisp_eval(s, "(fib 10)");
+    sclisp_eval(s, "(+ 1 \"one\")");
+    sclisp_eval(s, "undefined-symbol");
+    sclisp_get_stats(s, &st);
+
+    printf("stats: evals=%lu calls=%lu builtins=%lu integers=%lu\n",
+            st.evals, st.function_calls, st.builtin_calls, st.integers);
+    printf("stats: lookups=%lu links=%lu peak depth=%lu\n",
+            st.scope_lookups, st.scope_links, st.peak_depth);
+    printf("stats: badarg=%lu err=%lu live delta=%ld\n",
+            st.errors[SCLISP_BADARG], st.errors[SCLISP_ERR],
+            (long)st.live_objects - (long)live);
+
+    sclisp_reset_stats(s);
+    sclisp_get_stats(s, &st);
+    printf("stats after reset: evals=%lu live=%s\n", st.evals,
+            st.live_objects ? "kept" : "cleared");
+
+    sclisp_destroy(s);
+}
+
+static double tick_clock(void *user)
+{
+    unsigned long *ticks = user;
+
+    return (double)++*ticks;
+}
+
+static void test_profile(void)
+{
+    struct sclisp *s = NULL;
+    struct sclisp_profile_entry *entries;
+    unsigned long count, i, ticks = 0;
+
+    if (sclisp_init(&s, NULL)) {
+        printf("profile: sclisp_init failed\n");
+        return;
+    }
+
+    sclisp_eval(s, "(set (fib n) (cond ((< n 2) n) "
+            "(#t (+ (fib (- n 1)) (fib (- n 2))))))");
+    sclisp_eval(s, "(set twice (lambda (f x) (f (f x))))");
+
+    sclisp_profile_start(s, tick_clock, &ticks);
+    sclisp_eval(s, "(fib 8)");
+    sclisp_eval(s, "(twice (lambda (x) (* x 2)) 5)");
+    sclisp_profile_stop(s);
+    sclisp_eval(s, "(fib 3)");
+
+    sclisp_profile_report(s, &entries, &count);
+    for (i = 0; i < count; ++i)
+        printf("profile: %s calls=%lu inclusive=%.0f exclusive=%.0f\n",
+                entries[i].name, entries[i].calls, entries[i].inclusive,
+                entries[i].exclusive);
+    sclisp_get_scope_api(s)->cb->free_func(sclisp_get_scope_api(s)->cb,
+            entries);
+
+    sclisp_profile_print(s);
+    sclisp_profile_reset(s);
+    sclisp_profile_report(s, &entries, &count);
+    printf("profile after reset: %lu entries\n", count);
+
+    sclisp_destroy(s);
+}
+
+static void test_sample(void)
+{
+    struct sclisp *s = NULL;
+    char *folded = NULL;
+
+    if (sclisp_init(&s, NULL)) {
+        printf("sample: sclisp_init failed\n");
+        return;
+    }
+
+    sclisp_eval(s, "(set (fib n) (cond ((< n 2) n) "
+            "(#t (+ (fib (- n 1)) (fib (- n 2))))))");
+
+    sclisp_sample_start(s, 100, 0);
+    sclisp_eval(s, "(fib 6)");
+    sclisp_sample_stop(s);
+
+    /* As if from a timer signal. */
+    sclisp_sample_start(s, 0, 0);
+    sclisp_sample_request(s);
+    sclisp_eval(s, "(fib 2)");
+    sclisp_sample_stop(s);
+
+    sclisp_sample_folded(s, &folded);
+    printf("folded:\n%s", folded ? folded : "(null)\n");
+    sclisp_get_scope_api(s)->cb->free_func(sclisp_get_scope_api(s)->cb,
+            folded);
+
+    /* A tiny buffer drops what does not fit. */
+    sclisp_sample_reset(s);
+    sclisp_sample_start(s, 1, 8);
+    sclisp_eval(s, "(fib 4)");
+    sclisp_sample_folded(s, &folded);
+    printf("folded small:\n%s", folded ? folded : "(null)\n");
+    sclisp_get_scope_api(s)->cb->free_func(sclisp_get_scope_api(s)->cb,
+            folded);
+
+    sclisp_destroy(s);
+}
+
+static void trace_hook(const struct sclisp_trace_event *ev, void *user)
+{
+    int *indent = user;
+
+    if (ev->kind == SCLISP_TRACE_ENTER)
+        printf("trace: %*s-> %s depth=%lu argc=%lu\n", *indent, "",
+                ev->name, ev->depth, ev->argc);
+    else
+        printf("trace: %*s<- %s err=%d\n", *indent, "", ev->name,
+                ev->err);
+}
+
+static void test_trace(void)
+{
+    struct sclisp *s = NULL;
+    struct sclisp_trace_event events[8];
+    unsigned long count, lost, i, ticks = 0;
+    int indent = 2;
+
+    if (sclisp_init(&s, NULL)) {
+        printf("trace: sclisp_init failed\n");
+        return;
+    }
+
+    sclisp_eval(s, "(set (add a b) (+ a b))");
+
+    sclisp_trace_hooks(s, trace_hook, trace_hook, &indent);
+    sclisp_eval(s, "(add 1 2)");
+    sclisp_eval(s, "(add 1 \"x\")");
+    sclisp_trace_hooks(s, NULL, NULL, NULL);
+
+    sclisp_trace_ring(s, 4, tick_clock, &ticks);
+    sclisp_eval(s, "(add (add 1 2) 3)");
+    sclisp_trace_read(s, events, 8, &count, &lost);
+    printf("trace ring: %lu events, %lu lost\n", count, lost);
+    for (i = 0; i < count; ++i)
+        printf("trace ring: %s %s depth=%lu time=%.0f\n",
+                events[i].kind == SCLISP_TRACE_ENTER ? "enter" : "exit",
+                events[i].name, events[i].depth, events[i].time);
+
+    sclisp_eval(s, "(+ 1 2)");
+    sclisp_trace_read(s, events, 1, &count, &lost);
+    printf("trace ring: read %lu of 2, %s\n", count, events[0].name);
+    sclisp_trace_ring(s, 0, NULL, NULL);
+
+    sclisp_destroy(s);
+}
+
+static unsigned long latency_clock(void *user)
+{
+    unsigned long *ticks = user;
+
+    return *ticks += 10;
+}
+
+static void test_latency(void)
+{
+    struct sclisp *s = NULL;
+    struct sclisp_histogram h, total;
+    unsigned long ticks = 0, i;
+
+    sclisp_hist_reset(&total);
+    for (i = 1; i <= 1000; ++i)
+        sclisp_hist_record(&total, i * 1000);
+    printf("hist: count=%lu min=%lu max=%lu\n", total.count, total.min,
+            total.max);
+    printf("hist: p50=%lu p99=%lu p100=%lu\n",
+            sclisp_hist_percentile(&total, 50),
+            sclisp_hist_percentile(&total, 99),
+            sclisp_hist_percentile(&total, 100));
+
+    if (sclisp_init(&s, NULL)) {
+        printf("latency: sclisp_init failed\n");
+        return;
+    }
+
+    sclisp_register_user_func(s, add_two, "add2", NULL, NULL);
+    sclisp_latency_start(s, latency_clock, &ticks);
+    sclisp_eval(s, "(add2 1 2)");
+    sclisp_eval(s, "(add2 (add2 1 2) 3)");
+    sclisp_latency_stop(s);
+    sclisp_eval(s, "(add2 1 2)");
+
+    sclisp_latency_eval(s, &h);
+    printf("latency eval: count=%lu min=%lu max=%lu\n", h.count, h.min,
+            h.max);
+    sclisp_latency_func(s, "add2", &h);
+    printf("latency add2: count=%lu min=%lu max=%lu p50=%lu\n", h.count,
+            h.min, h.max, sclisp_hist_percentile(&h, 50));
+    printf("latency car: %d\n", sclisp_latency_func(s, "car", &h));
+
+    sclisp_hist_merge(&total, &h);
+    printf("hist merged: count=%lu min=%lu\n", total.count, total.min);
+
+    sclisp_latency_reset(s);
+    sclisp_latency_func(s, "add2", &h);
+    printf("latency add2 after reset: count=%lu\n", h.count);
+
+    sclisp_destroy(s);
+}
+
+static void test_heap(void)
+{
+    static const char *const types[SCLISP_CENSUS_TYPES] = {
+        "integer", "real", "string", "symbol", "function", "builtin", "cell"
+    };
+    const char *path = "sclisp-test-heap.txt";
+    struct sclisp *s = NULL;
+    struct sclisp_census census;
+    struct sclisp_alloc_site *sites;
+    unsigned long count, i;
+    char line[256];
+    FILE *f;
+
+    if (sclisp_init(&s, NULL)) {
+        printf("heap: sclisp_init failed\n");
+        return;
+    }
+
+    sclisp_alloc_sites_start(s);
+    sclisp_eval(s, "(set (pair a b) (cons a (cons b nil)))");
+    sclisp_eval(s, "(set p (pair 1 \"two\"))");
+    sclisp_eval(s, "(set q (+ 1 2))");
+    sclisp_alloc_sites_stop(s);
+
+    sclisp_heap_census(s, &census);
+    for (i = 0; i < SCLISP_CENSUS_TYPES; ++i)
+        if (census.objects[i])
+            printf("heap census: %s %lu\n", types[i], census.objects[i]);
+
+    sclisp_alloc_sites(s, &sites, &count);
+    for (i = 0; i < count; ++i)
+        printf("heap site: %s allocs=%lu live=%lu\n", sites[i].name,
+                sites[i].allocs, sites[i].objects);
+    sclisp_get_scope_api(s)->cb->free_func(sclisp_get_scope_api(s)->cb,
+            sites);
+
+    printf("heap dump: %d\n", sclisp_heap_dump(s, path));
+    if ((f = fopen(path, "r"))) {
+        while (fgets(line, sizeof(line), f))
+            if (!strncmp(line, "root 0 p ", 9) ||
+                    strstr(line, " cons "))
+                printf("heap dump: %s", line);
+        fclose(f);
+    }
+    remove(path);
+
+    printf("heap dump bad path: %d\n",
+            sclisp_heap_dump(s, "sclisp-missing-dir/heap.txt"));
+
+    sclisp_destroy(s);
+}
+
 void sclisp_test_external(void)
 {
     struct sclisp* s;
@@ -170,5 +666,18 @@ void sclisp_test_external(void)
     api->get_integer(api, "bar", &integer);
     printf("integer: %ld\n", integer);
 
+    test_load_file(s);
+
     sclisp_destroy(s);
+
+    test_import();
+    test_image();
+    test_serialize();
+    test_json();
+    test_stats();
+    test_profile();
+    test_sample();
+    test_trace();
+    test_latency();
+    test_heap();
 }
@@ -49,7 +49,7 @@ static struct Object* builtin_printx(struct Object *args, void *user)
 {
     struct Object *x;
     struct sclisp *s = (struct sclisp *)user;
-    int res = scope_query(s->scope, "x", &x);
+    int res = scope_query(s, s->scope, "x", &x);
 
     (void)args;
 
@@ -74,6 +74,9 @@ static const char* TokenTag_to_str(enum TokenTag tag)
         case TOK_LPAREN: return "TOK_LPAREN";
         case TOK_RPAREN: return "TOK_RPAREN";
         case TOK_QUOTE: return "TOK_QUOTE";
+        case TOK_BACKQUOTE: return "TOK_BACKQUOTE";
+        case TOK_UNQUOTE: return "TOK_UNQUOTE";
+        case TOK_UNQUOTE_SPLICING: return "TOK_UNQUOTE_SPLICING";
         case TOK_UNKOWN: return "TOK_UNKOWN";
     }
 
@@ -104,6 +107,12 @@ static const char* TokenContents_to_str(struct Token *tok)
             return ")";
         case TOK_QUOTE:
             return "'";
+        case TOK_BACKQUOTE:
+            return "`";
+        case TOK_UNQUOTE:
+            return ",";
+        case TOK_UNQUOTE_SPLICING:
+            return ",@";
         case TOK_UNKOWN:
             return "(unknown)";
     }
@@ -111,11 +120,1254 @@ static const char* TokenContents_to_str(struct Token *tok)
     return "UNDEFINED";
 }
 
+/***************************************************
+ * Allocation tracking
+ **************************************************/
+
+/* Every block is prefixed with its size so that frees can be charged
+   against the live byte count. */
+union AllocHeader {
+    unsigned long size;
+    double d;
+    void *p;
+};
+
+struct AllocTracker {
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long live_bytes;
+    unsigned long limit; /* allocations allowed to succeed, 0 for any */
+};
+
+static void* tracking_alloc_func(struct sclisp_cb *cb, unsigned long sz)
+{
+    struct AllocTracker *t = cb->user;
+    union AllocHeader *h;
+
+    if (t->limit && t->allocs == t->limit)
+        return NULL;
+
+    h = malloc(sizeof(*h) + sz);
+    if (!h)
+        return NULL;
+
+    h->size = sz;
+    ++t->allocs;
+    t->live_bytes += sz;
+
+    return h + 1;
+}
+
+static void* tracking_zalloc_func(struct sclisp_cb *cb, unsigned long sz)
+{
+    void *mem = tracking_alloc_func(cb, sz);
+
+    if (mem)
+        memset(mem, 0, sz);
+
+    return mem;
+}
+
+static void tracking_free_func(struct sclisp_cb *cb, void *mem)
+{
+    struct AllocTracker *t = cb->user;
+    union AllocHeader *h = mem;
+
+    if (!mem)
+        return;
+
+    --h;
+    ++t->frees;
+    t->live_bytes -= h->size;
+    free(h);
+}
+
+static void tracking_print_func(struct sclisp_cb *cb, int fd, const char *str)
+{
+    (void)cb;
+    (void)fd;
+    (void)str;
+}
+
+static int failures = 0;
+
+#define EXPECT_EQ(_a, _b)                                           \
+    do {                                                            \
+        long _va = (long)(_a), _vb = (long)(_b);                    \
+        if (_va != _vb) {                                           \
+            printf("FAIL %s:%d: %s == %ld, expected %ld\n",         \
+                    __FILE__, __LINE__, #_a, _va, _vb);             \
+            ++failures;                                             \
+        }                                                           \
+    } while (0)
+
+/* Evaluate a pre-parsed expression, so that only the evaluator itself
+   is measured. Returns the number of allocations made by the
+   evaluation and stores the number of blocks it left live once the
+   result and expression were released. Any error is left in s->le. */
+static long eval_allocs(struct sclisp *s, struct AllocTracker *t,
+        const char *expr, long *live)
+{
+    unsigned long allocs, frees;
+    struct Object *parsed, *res;
+    long count;
+
+    allocs = t->allocs;
+    frees = t->frees;
+    s->le = SCLISP_OK;
+
+    parsed = parse_expr(s, expr);
+    count = t->allocs;
+    res = internal_eval(s, parsed);
+    count = t->allocs - count;
+
+    object_unref(s, res);
+    object_unref(s, parsed);
+
+    *live = (long)(t->allocs - allocs) - (long)(t->frees - frees);
+
+    return count;
+}
+
+static void test_alloc_counts(void)
+{
+    struct AllocTracker t = { 0, 0, 0, 0 };
+    struct sclisp_cb cb;
+    struct sclisp *s = NULL;
+    unsigned long allocs;
+    long live;
+    char *repr;
+
+    cb.alloc_func = tracking_alloc_func;
+    cb.zalloc_func = tracking_zalloc_func;
+    cb.free_func = tracking_free_func;
+    cb.print_func = tracking_print_func;
+    cb.getchar_func = NULL;
+    cb.user = &t;
+
+    if (sclisp_init(&s, &cb) != SCLISP_OK) {
+        printf("FAIL test_alloc_counts: sclisp_init failed\n");
+        ++failures;
+        return;
+    }
+
+    sclisp_eval(s, "(set x 5)");
+    sclisp_eval(s, "(set (add a b) (+ a b))");
+
+    /* Literals and bound symbols are shared, not copied. */
+    EXPECT_EQ(eval_allocs(s, &t, "42", &live), 0);
+    EXPECT_EQ(live, 0);
+    EXPECT_EQ(eval_allocs(s, &t, "x", &live), 0);
+    EXPECT_EQ(live, 0);
+    EXPECT_EQ(eval_allocs(s, &t, "(quote (1 2 3))", &live), 0);
+    EXPECT_EQ(live, 0);
+
+    /* Arithmetic allocates only its result. */
+    EXPECT_EQ(eval_allocs(s, &t, "(+ 1 2)", &live), 1);
+    EXPECT_EQ(live, 0);
+    EXPECT_EQ(eval_allocs(s, &t, "(* x 2.5)", &live), 1);
+    EXPECT_EQ(live, 0);
+
+    /* A call allocates a scope and a binding plus its symbol per
+       argument, all released on return. */
+    sclisp_reset_stats(s);
+    EXPECT_EQ(eval_allocs(s, &t, "(add 1 2)", &live), 6);
+    EXPECT_EQ(live, 0);
+    EXPECT_EQ(s->stats.function_calls, 1);
+    EXPECT_EQ(s->stats.builtin_calls, 1);
+    EXPECT_EQ(s->stats.internal_evals, 8);
+    EXPECT_EQ(s->stats.peak_depth, 3);
+    EXPECT_EQ(eval_allocs(s, &t, "(add x (add 1 2))", &live), 12);
+    EXPECT_EQ(live, 0);
+    EXPECT_EQ(eval_allocs(s, &t, "((lambda (q) q) 7)", &live), 4);
+    EXPECT_EQ(live, 0);
+
+    /* Errors inside a call must not strand its scope. */
+    sclisp_reset_stats(s);
+    eval_allocs(s, &t, "(add 1 \"one\")", &live);
+    EXPECT_EQ(s->le, SCLISP_BADARG);
+    EXPECT_EQ(s->stats.errors[SCLISP_BADARG], 1);
+    EXPECT_EQ(live, 0);
+    EXPECT_EQ(s->scope->parent, 0);
+
+    /* A new binding keeps its symbol, binding and value; rebinding
+       allocates nothing and releases the old value. */
+    EXPECT_EQ(eval_allocs(s, &t, "(set y 3)", &live), 2);
+    EXPECT_EQ(live, 3);
+    EXPECT_EQ(eval_allocs(s, &t, "(set y 4)", &live), 0);
+    EXPECT_EQ(live, 0);
+
+    allocs = t.allocs;
+    repr = internal_repr(s, s->lr);
+    EXPECT_EQ(t.allocs - allocs, 1);
+    s->cb->free_func(s->cb, repr);
+
+    sclisp_destroy(s);
+
+    EXPECT_EQ(t.allocs, t.frees);
+    EXPECT_EQ(t.live_bytes, 0);
+
+    /* Running out of memory anywhere in init fails cleanly. */
+    for (allocs = 1; ; ++allocs) {
+        memset(&t, 0, sizeof(t));
+        t.limit = allocs;
+        if (sclisp_init(&s, &cb) == SCLISP_OK)
+            break;
+        EXPECT_EQ(t.live_bytes, 0);
+    }
+    EXPECT_EQ(allocs > 100, 1);
+    sclisp_destroy(s);
+}
+
 /***************************************************
  * Internal test main function
  **************************************************/
 
-void sclisp_test_internal(void)
+static unsigned long census_total(const struct sclisp_census *c)
+{
+    unsigned long n = 0;
+    int i;
+
+    for (i = 0; i < SCLISP_CENSUS_TYPES; ++i)
+        n += c->objects[i];
+
+    return n;
+}
+
+static void test_census(void)
+{
+    struct sclisp *s = NULL;
+    struct ObjMap m = { NULL, 0, 0 };
+    struct Object objs[300];
+    unsigned long val, i;
+
+    if (sclisp_init(&s, NULL)) {
+        printf("FAIL test_census: sclisp_init failed\n");
+        ++failures;
+        return;
+    }
+
+    /* Remove every third key, then check the remaining ones are still
+       reachable after their probe sequences were shifted back. */
+    for (i = 0; i < 300; ++i)
+        objmap_put(s, &m, &objs[i], i);
+    for (i = 0; i < 300; i += 3)
+        EXPECT_EQ(objmap_take(&m, &objs[i], &val) && val == i, 1);
+    EXPECT_EQ(m.count, 200);
+    for (i = 0; i < 300; ++i)
+        EXPECT_EQ(objmap_get(&m, &objs[i], &val), i % 3 != 0);
+    objmap_free(s, &m);
+
+    sclisp_eval(s, "(set greeting \"hello\")");
+    sclisp_eval(s, "(set (pair a b) (cons a (cons b nil)))");
+    sclisp_eval(s, "(set p (pair 1.5 greeting))");
+    EXPECT_EQ(census_total(&s->census), s->stats.live_objects);
+    EXPECT_EQ(s->census.bytes[SCLISP_CENSUS_STRING] >=
+            s->census.objects[SCLISP_CENSUS_STRING] * sizeof(struct Object)
+            + 6, 1);
+
+    sclisp_alloc_sites_start(s);
+    sclisp_eval(s, "(set q (pair 1 2))");
+    sclisp_alloc_sites_stop(s);
+    sclisp_eval(s, "(set q nil)");
+    EXPECT_EQ(s->sites->tags.count, 0);
+    EXPECT_EQ(census_total(&s->census), s->stats.live_objects);
+
+    sclisp_destroy(s);
+}
+
+/* Evaluates expr and describes the result or error for comparison. */
+static void describe_eval(struct sclisp *s, const char *expr, char *out)
+{
+    char *repr;
+
+    if (sclisp_eval(s, expr)) {
+        sprintf(out, "error %d", s->le);
+        return;
+    }
+
+    repr = internal_repr(s, s->lr);
+    sprintf(out, "%.60s", repr ? repr : "?");
+    s->cb->free_func(s->cb, repr);
+}
+
+/* Evaluates each expression three times in both instances, expecting
+   the same outcome. */
+static void compare_evals(const char *test, struct sclisp *a,
+        struct sclisp *b, const char *const *exprs, unsigned long count)
+{
+    char want[64], got[64];
+    unsigned long i, j;
+
+    for (i = 0; i < count; ++i) {
+        for (j = 0; j < 3; ++j) {
+            describe_eval(a, exprs[i], want);
+            describe_eval(b, exprs[i], got);
+            if (strcmp(want, got)) {
+                printf("FAIL %s: %s gave %s, expected %s\n", test,
+                        exprs[i], got, want);
+                ++failures;
+            }
+        }
+    }
+}
+
+/* Evaluates each case in a new instance, expecting the description
+   paired with it. Returns the instance for further checks, or NULL if
+   it could not be created. */
+static struct sclisp* run_cases(const char *test,
+        const char *const (*cases)[2], unsigned long count)
+{
+    struct sclisp *s = NULL;
+    unsigned long i;
+    char got[64];
+
+    if (sclisp_init(&s, NULL)) {
+        printf("FAIL %s: sclisp_init failed\n", test);
+        ++failures;
+        return NULL;
+    }
+
+    for (i = 0; i < count; ++i) {
+        describe_eval(s, cases[i][0], got);
+        if (strcmp(got, cases[i][1])) {
+            printf("FAIL %s: %s gave %s, expected %s\n", test,
+                    cases[i][0], got, cases[i][1]);
+            ++failures;
+        }
+    }
+
+    return s;
+}
+
+static void test_specialize(void)
+{
+    static const char *const exprs[] = {
+        "(set add (lambda (a b) (+ a b)))",
+        "(set lt (lambda (a b) (< a b)))",
+        "(set quot (lambda (a b) (/ a b)))",
+        "(set rem (lambda (a b) (mod a b)))",
+        "(add 1 2)", "(add 1 2)", "(lt 1 2)", "(lt 2 2)",
+        "(quot 7 2)", "(quot 7 0)", "(rem -7 3)", "(rem 7 0)",
+        /* Type changes turn the nodes generic. */
+        "(add 1.5 2)", "(add 1 2.5)", "(add nil 2)", "(add \"x\" 2)",
+        "(lt 1.5 2)", "(lt \"a\" \"b\")",
+        "(set radd (lambda (a b) (+ a b)))",
+        "(radd 1.5 2.5)", "(radd 1 2)", "(radd 1.5 2.5)",
+        "(set rdiv (lambda (a b) (/ a b)))",
+        "(rdiv 1.0 4.0)", "(rdiv 1.0 0.0)", "(rdiv 1.0 4.0)",
+        /* Operators rebound behind a specialized node. */
+        "(set sub (lambda (a b) (- a b)))", "(sub 5 3)",
+        "(set twice (lambda (-) (sub 5 3)))", "(twice +)", "(sub 5 3)",
+        /* Call sites of redefined or mismatched lambdas. */
+        "(set g (lambda (a b) (- a b)))", "(set h (lambda (x) (g x 1)))",
+        "(h 10)", "(set g (lambda (b a) (- a b)))", "(h 10)",
+        "(set g (lambda (a) a))", "(h 10)",
+        "(set g (lambda (a a) a))", "(h 10)",
+        "(set g +)", "(h 10)"
+    };
+    struct sclisp *spec = NULL, *plain = NULL;
+    struct Object *sq, *node;
+
+    if (sclisp_init(&spec, NULL) || sclisp_init(&plain, NULL)) {
+        printf("FAIL test_specialize: sclisp_init failed\n");
+        ++failures;
+        return;
+    }
+
+    sclisp_set_specialize(plain, 0);
+    #if SCLISP_JIT_SUPPORT
+        sclisp_jit_set_threshold(spec, 0);
+        sclisp_jit_set_threshold(plain, 0);
+    #endif
+
+    compare_evals("test_specialize", plain, spec, exprs,
+            sizeof(exprs) / sizeof(exprs[0]));
+
+    EXPECT_EQ(spec->stats.node_rewrites > 0, 1);
+    EXPECT_EQ(spec->stats.node_deopts > 0, 1);
+    EXPECT_EQ(plain->stats.node_rewrites, 0);
+
+    /* The body of sq specializes on its first call and stays that way
+       until it sees a real. */
+    sclisp_eval(spec, "(set sq (lambda (x) (* x x)))");
+    sclisp_eval(spec, "(sq 3)");
+    if (!scope_query(spec, spec->scope, "sq", &sq)) {
+        node = internal_car(sq->o.atom.a.function.body);
+        EXPECT_EQ(node->o.cell.spec, NODE_INT);
+        sclisp_eval(spec, "(sq 4)");
+        EXPECT_EQ(node->o.cell.spec, NODE_INT);
+        sclisp_eval(spec, "(sq 1.5)");
+        EXPECT_EQ(node->o.cell.spec, NODE_GENERIC);
+        object_unref(spec, sq);
+    } else
+        EXPECT_EQ(0, 1);
+
+    sclisp_destroy(spec);
+    sclisp_destroy(plain);
+}
+
+static void test_fold(void)
+{
+    static const char *const exprs[] = {
+        "(* 60 60 24)", "(+ 1 (* 2 3) (- 10 4))", "(< 1 2.5)",
+        "(& 12 10)", "(~ 5)", "(nil? nil)", "(atom? (quote (1)))",
+        /* Errors are left for evaluation to report. */
+        "(/ 1 0)", "(~ 1.5)", "(+ 1 \"x\")",
+        "(set (day) (* 60 60 24))", "(day)", "(day)",
+        "(set (off) (+ base 10))", "(off)",
+        "(set (truth) (cond ((true? #t) 1)))", "(truth)",
+        /* A local binding of an operator shadows it for callees. */
+        "(set (shadow *) (day))", "(shadow +)", "(day)"
+    };
+    static const char *const specs[] = {
+        "(lin 5)", "(lin 1.5)", "(seen 1)", "(bump1 2)", "(quoted 0)",
+        "(unit)", "(unit)"
+    };
+    static const char *const rebound[] = {
+        "(set * +)", "(day)", "(* 2 3)", "(set #t 0)", "(truth)"
+    };
+    struct sclisp *fold = NULL, *plain = NULL, *s;
+    struct Object *fn;
+    unsigned long folds;
+    char out[64];
+    int i;
+
+    if (sclisp_init(&fold, NULL) || sclisp_init(&plain, NULL)) {
+        printf("FAIL test_fold: sclisp_init failed\n");
+        ++failures;
+        return;
+    }
+
+    sclisp_set_specialize(plain, 0);
+    sclisp_eval(fold, "(set base 32)");
+    sclisp_eval(plain, "(set base 32)");
+    EXPECT_EQ(sclisp_mark_constant(fold, "base", 1), SCLISP_OK);
+    EXPECT_EQ(sclisp_mark_constant(fold, "unbound", 1), SCLISP_BADARG);
+
+    compare_evals("test_fold", plain, fold, exprs,
+            sizeof(exprs) / sizeof(exprs[0]));
+
+    EXPECT_EQ(fold->stats.node_folds > 0, 1);
+    EXPECT_EQ(plain->stats.node_folds, 0);
+    EXPECT_EQ(fold->stats.errors[SCLISP_BADARG],
+            plain->stats.errors[SCLISP_BADARG]);
+    EXPECT_EQ(fold->stats.errors[SCLISP_UNSUPPORTED],
+            plain->stats.errors[SCLISP_UNSUPPORTED]);
+
+    if (!scope_query(fold, fold->scope, "day", &fn)) {
+        EXPECT_EQ(internal_car(fn->o.atom.a.function.body)->o.cell.spec,
+                NODE_CONST);
+        object_unref(fold, fn);
+    } else
+        EXPECT_EQ(0, 1);
+
+    for (i = 0; i < 2; ++i) {
+        s = i ? fold : plain;
+        sclisp_eval(s, "(set (scale x y z) (+ (* x y) z))");
+        sclisp_eval(s, "(set (peek) y)");
+        sclisp_eval(s, "(set (use x y) (+ x (peek)))");
+        sclisp_eval(s, "(set (bump x y) (set y (+ y x)) y)");
+        sclisp_eval(s, "(set (quote-y x y) (quote y))");
+        sclisp_eval(s, "(set (area w h) (* w h))");
+        folds = s->stats.node_folds;
+        EXPECT_EQ(sclisp_specialize(s, "lin", "scale",
+                "((y 2) (z (* 3 4)))"), SCLISP_OK);
+        EXPECT_EQ(sclisp_specialize(s, "seen", "use", "((y 7))"),
+                SCLISP_OK);
+        EXPECT_EQ(sclisp_specialize(s, "bump1", "bump", "((y 1))"),
+                SCLISP_OK);
+        EXPECT_EQ(sclisp_specialize(s, "quoted", "quote-y", "((y 5))"),
+                SCLISP_OK);
+        EXPECT_EQ(sclisp_specialize(s, "unit", "area", "((h 4) (w 3))"),
+                SCLISP_OK);
+        EXPECT_EQ(s->stats.node_folds > folds, i);
+        EXPECT_EQ(sclisp_specialize(s, "bad", "scale", "((w 1))"),
+                SCLISP_BADARG);
+        EXPECT_EQ(sclisp_specialize(s, "bad", "scale", "((y 1) (y 2))"),
+                SCLISP_BADARG);
+        EXPECT_EQ(sclisp_specialize(s, "bad", "base", "()"),
+                SCLISP_BADARG);
+        EXPECT_EQ(sclisp_errmsg(s) != NULL, 1);
+        EXPECT_EQ(sclisp_specialize(s, "bad", "nonesuch", "()"),
+                SCLISP_BADARG);
+        EXPECT_EQ(sclisp_errmsg(s) != NULL, 1);
+        EXPECT_EQ(sclisp_specialize(s, "bad", "scale", "garbage"),
+                SCLISP_BADARG);
+    }
+
+    compare_evals("test_fold", plain, fold, specs,
+            sizeof(specs) / sizeof(specs[0]));
+
+    /* Constants cannot be set until they are unmarked. */
+    EXPECT_EQ(sclisp_eval(fold, "(set base 1)"), SCLISP_BADARG);
+    EXPECT_EQ(sclisp_mark_constant(fold, "base", 0), SCLISP_OK);
+    EXPECT_EQ(sclisp_eval(fold, "(set base 1)"), SCLISP_OK);
+    describe_eval(fold, "(off)", out);
+    EXPECT_EQ(strcmp(out, "11"), 0);
+    sclisp_eval(plain, "(set base 1)");
+
+    /* Marking a name constant leaves parameters free to share it,
+       whether or not specialization is on. */
+    for (i = 0; i < 2; ++i) {
+        s = i ? fold : plain;
+        sclisp_eval(s, "(set rate 3)");
+        EXPECT_EQ(sclisp_mark_constant(s, "rate", 1), SCLISP_OK);
+        EXPECT_EQ(sclisp_eval(s, "(set (g rate) (* rate 10))"), SCLISP_OK);
+        describe_eval(s, "(g 5 6)", out);
+        EXPECT_EQ(strcmp(out, "50"), 0);
+        describe_eval(s, "((lambda (rate) rate) 7)", out);
+        EXPECT_EQ(strcmp(out, "7"), 0);
+        sclisp_eval(s, "(set (call f) (f 4))");
+        sclisp_eval(s, "(call (lambda (x) x))");
+        describe_eval(s, "(call g)", out);
+        EXPECT_EQ(strcmp(out, "40"), 0);
+        EXPECT_EQ(sclisp_eval(s, "(set rate 4)"), SCLISP_BADARG);
+        describe_eval(s, "rate", out);
+        EXPECT_EQ(strcmp(out, "3"), 0);
+        EXPECT_EQ(sclisp_mark_constant(s, "rate", 0), SCLISP_OK);
+    }
+
+    /* Rebinding an operator or #t globally invalidates folded calls. */
+    compare_evals("test_fold", plain, fold, rebound,
+            sizeof(rebound) / sizeof(rebound[0]));
+    EXPECT_EQ(fold->op_shadows, 0);
+
+    sclisp_destroy(fold);
+    sclisp_destroy(plain);
+}
+
+static void test_inline(void)
+{
+    static const char *const exprs[] = {
+        "(set (sq x) (* x x))", "(set (inc x) (+ x 1))",
+        "(set (poly x) (+ (sq x) (inc x)))",
+        "(set (f y) (poly (* y 2)))",
+        "(f 3)", "(f 2.5)", "(f nil)", "(f \"x\")",
+        /* Free symbols see the parameters of the callers. */
+        "(set (getx) x)", "(set (wrap x) (getx))",
+        "(set (outer y) (wrap (+ y 1)))", "(outer 4)",
+        /* Arguments are evaluated once, in order, even if unused. */
+        "(set (pick c a b) (cond (c a) (#t b)))", "(set (ignore x) 1)",
+        "(set (p1 c) (pick c 2 3))", "(set (p2 c) (pick c (/ 1 0) 3))",
+        "(set (i1) (ignore 5))", "(set (i2) (ignore (/ 1 0)))",
+        "(p1 0)", "(p1 1)", "(p2 0)", "(p2 1)", "(i1)", "(i2)",
+        "(set (fact n) (cond ((< n 2) 1) (#t (* n (fact (- n 1))))))",
+        "(set (fact n) (cond ((< n 2) 1) (#t (* n (fact (- n 1))))))",
+        "(fact 5)",
+        /* Rebinding the lambda or anything expanded into it. */
+        "(set (g x) (+ x 1))", "(set (h y) (g y))", "(set (k y) (h y))",
+        "(h 1)", "(k 1)", "(set (g x) (- x 1))", "(h 1)", "(k 1)",
+        "(set (m g) (k 2))", "(m (lambda (x) 99))", "(k 2)",
+        "(set (sh +) (inc 1))", "(sh -)", "(inc 1)",
+        /* Which error is reported must not depend on inlining. */
+        "(set (f3 x y) (~ #t x))", "(set (f2 x y) (f3 (<= 1 2 3) -3))",
+        "(try (f2 1 2) (errmsg))",
+        "(set (swap a b) (- b a))", "(set (s1) (swap nope (car 1 2)))",
+        "(set (s2) (swap (car 1 2) \"x\"))", "(set (s3 v) (swap v (sq v)))",
+        "(try (s1) (errmsg))", "(try (s2) (errmsg))",
+        "(try (s3 \"x\") (errmsg))", "(s3 4)"
+    };
+    struct sclisp *inl = NULL, *plain = NULL;
+
+    if (sclisp_init(&inl, NULL) || sclisp_init(&plain, NULL)) {
+        printf("FAIL test_inline: sclisp_init failed\n");
+        ++failures;
+        return;
+    }
+
+    sclisp_set_specialize(plain, 0);
+    #if SCLISP_JIT_SUPPORT
+        sclisp_jit_set_threshold(inl, 0);
+    #endif
+
+    compare_evals("test_inline", plain, inl, exprs,
+            sizeof(exprs) / sizeof(exprs[0]));
+
+    EXPECT_EQ(inl->stats.node_inlines > 0, 1);
+    EXPECT_EQ(plain->stats.node_inlines, 0);
+    EXPECT_EQ(inl->op_shadows, 0);
+
+    /* Rebinding g above invalidated every expansion. In a new one,
+       only the call of f itself is left. */
+    sclisp_eval(inl, "(set (f y) (poly (* y 2)))");
+    sclisp_reset_stats(inl);
+    sclisp_eval(inl, "(f 3)");
+    EXPECT_EQ(inl->stats.function_calls, 1);
+
+    sclisp_destroy(inl);
+    sclisp_destroy(plain);
+}
+
+static void test_macro(void)
+{
+    static const char *const cases[][2] = {
+        { "(defmacro (unless c a b) (list (quote cond) (list c b) (list #t a)))",
+            "unless" },
+        { "(unless 0 1 2)", "1" }, { "(unless 1 1 2)", "2" },
+        { "(unless 1 (/ 1 0) 2)", "2" },
+        { "(defmacro (let1 v e body) (list (list (quote lambda) (list v) body) e))",
+            "let1" },
+        { "(defmacro (begin &rest body) "
+            "(list (cons (quote lambda) (cons nil body))))", "begin" },
+        { "(begin 1 2 3)", "3" }, { "(begin)", "nil" },
+        /* Macros may use macros, and gensym keeps names apart. */
+        { "(defmacro (swap a b) (let1 t (gensym) "
+            "(list (quote let1) t a (list (quote list) b t))))", "swap" },
+        { "(set t 1)", "1" }, { "(swap t 2)", "(2 1)" },
+        { "(set (f x) (unless (< x 0) (let1 y (* x 2) (+ y 1)) 0))", "<func>" },
+        { "(f 5)", "11" }, { "(f -5)", "0" },
+        /* Quoted forms and parameter lists are not expanded. */
+        { "(quote (unless 1 2 3))", "(unless 1 2 3)" },
+        { "((lambda (begin) begin) 4)", "4" },
+        { "(eval (list (quote unless) 0 5 6))", "5" },
+        { "(defmacro (forever x) (list (quote forever) x))", "forever" },
+        { "(forever 1)", "error 5" }, { "(defmacro (oops) (car 1 2))", "oops" },
+        { "(oops)", "error 3" }, { "(defmacro (bad &rest) 1)", "error 3" },
+        { "(defmacro (bad &rest a b) 1)", "error 3" },
+        { "(defmacro bad 1)", "error 3" }, { "(gensym 1)", "error 3" }
+    };
+    struct sclisp *s;
+
+    if (!(s = run_cases("test_macro", cases,
+                    sizeof(cases) / sizeof(cases[0]))))
+        return;
+
+    /* Expansion happened when f was defined. */
+    sclisp_reset_stats(s);
+    EXPECT_EQ(sclisp_eval(s, "(f 5)"), SCLISP_OK);
+    EXPECT_EQ(s->stats.function_calls, 2);
+
+    sclisp_destroy(s);
+}
+
+static void test_quasiquote(void)
+{
+    static const char *const cases[][2] = {
+        { "(set x 5)", "5" }, { "(set xs (list 1 2))", "(1 2)" },
+        { "`(a b c)", "(a b c)" }, { "`(a ,x c)", "(a 5 c)" },
+        { "`(a ,@xs c)", "(a 1 2 c)" }, { "`(a ,@xs)", "(a 1 2)" },
+        { "`(,@xs ,@xs)", "(1 2 1 2)" }, { "`(a ,@nil b)", "(a b)" },
+        { "`(1 (2 ,(+ x 1)) 3)", "(1 (2 6) 3)" },
+        { "`,x", "5" }, { "`x", "x" }, { "`7", "7" }, { "`()", "nil" },
+        { "`(a '(b ,x))", "(a (quote (b 5)))" },
+        /* Inner templates keep their own unquotes. */
+        { "`(a `(b ,(c ,x)))", "(a (quasiquote (b (unquote (c 5)))))" },
+        { "(defmacro (unless c a b) `(cond (,c ,b) (#t ,a)))", "unless" },
+        { "(unless 0 1 2)", "1" }, { "(unless 1 1 2)", "2" },
+        { "`(,@x b)", "error 3" }, { "`,@xs", "error 1" },
+        { "(list ')", "error 1" },
+        { "(append)", "nil" }, { "(append (list 1) nil (list 2) 3)",
+            "(1 2 . 3)" }, { "(append 1 (list 2))", "error 3" },
+        /* Templates do not depend on the names cons and append. */
+        { "(set cons 0)", "0" }, { "(set append 0)", "0" },
+        { "`(,x ,@xs 3)", "(5 1 2 3)" }
+    };
+    struct sclisp *s;
+    struct Object *first;
+    char got[64];
+
+    if (!(s = run_cases("test_quasiquote", cases,
+                    sizeof(cases) / sizeof(cases[0]))))
+        return;
+
+    /* Constant parts are built once and shared by every evaluation. */
+    EXPECT_EQ(sclisp_eval(s, "(set (f y) `(a b ,y c d))"), SCLISP_OK);
+    EXPECT_EQ(sclisp_eval(s, "(f 1)"), SCLISP_OK);
+    first = object_ref(s->lr);
+    describe_eval(s, "(f 2)", got);
+    EXPECT_EQ(strcmp(got, "(a b 2 c d)"), 0);
+    EXPECT_EQ(first == s->lr, 0);
+    EXPECT_EQ(internal_cdr(internal_cdr(internal_cdr(first))) ==
+            internal_cdr(internal_cdr(internal_cdr(s->lr))), 1);
+    object_unref(s, first);
+
+    EXPECT_EQ(sclisp_eval(s, "(set (g) `(a (b c) d))"), SCLISP_OK);
+    EXPECT_EQ(sclisp_eval(s, "(g)"), SCLISP_OK);
+    first = object_ref(s->lr);
+    EXPECT_EQ(sclisp_eval(s, "(g)"), SCLISP_OK);
+    EXPECT_EQ(first == s->lr, 1);
+    object_unref(s, first);
+
+    /* A splice ending its list is not copied. */
+    EXPECT_EQ(sclisp_eval(s, "(set (h y) `(a ,@y))"), SCLISP_OK);
+    EXPECT_EQ(sclisp_eval(s, "xs"), SCLISP_OK);
+    first = object_ref(s->lr);
+    EXPECT_EQ(sclisp_eval(s, "(h xs)"), SCLISP_OK);
+    EXPECT_EQ(internal_cdr(s->lr) == first, 1);
+    object_unref(s, first);
+
+    sclisp_destroy(s);
+}
+
+static void test_try(void)
+{
+    static const char *const cases[][2] = {
+        { "(try 1 2)", "1" }, { "(lasterror)", "0" }, { "(errmsg)", "nil" },
+        { "(try (car 1 2) 5)", "5" }, { "(lasterror)", "3" },
+        { "(errmsg)", "\"needs exactly one argument\"" },
+        { "(try (throw \"boom\") (list (lasterror) (errmsg)))",
+            "(1 \"boom\")" },
+        { "(try (try (throw \"a\") (throw (errmsg))) (errmsg))", "\"a\"" },
+        { "(set (down n) (cond ((== n 0) (throw \"bottom\")) "
+            "(#t (+ 1 (down (- n 1))))))", "<func>" },
+        { "(try (down 200) (errmsg))", "\"bottom\"" },
+        { "(set (safe n) (try (down n) -1))", "<func>" },
+        { "(+ (safe 10) 1)", "0" },
+        /* Errors in the handler are not caught by the same try. */
+        { "(try (throw \"a\") (car 1 2))", "error 3" },
+        { "(try 1)", "error 3" }, { "(try 1 2 3)", "error 3" },
+        { "(throw 1)", "error 3" }, { "(lasterror 1)", "error 3" },
+        /* A bad throw is itself an error that try catches. */
+        { "(try (throw 5) (list (lasterror) (errmsg)))",
+            "(3 \"throw needs a string\")" },
+        { "(errmsg 1)", "error 3" }
+    };
+    struct sclisp *s;
+
+    if (!(s = run_cases("test_try", cases,
+                    sizeof(cases) / sizeof(cases[0]))))
+        return;
+
+    /* Uncaught throws reach the host with their message. */
+    EXPECT_EQ(sclisp_eval(s, "(down 3)"), SCLISP_ERR);
+    EXPECT_EQ(strcmp(sclisp_errmsg(s), "bottom"), 0);
+
+    /* Catching leaves the evaluator as it found it. */
+    EXPECT_EQ(sclisp_profile_start(s, NULL, NULL), SCLISP_OK);
+    EXPECT_EQ(sclisp_sample_start(s, 1, 0), SCLISP_OK);
+    EXPECT_EQ(sclisp_eval(s, "(+ (try (down 50) 1) (safe 20))"), SCLISP_OK);
+    EXPECT_EQ(s->lr->o.atom.a.integer, 0);
+    EXPECT_EQ(s->depth, 0);
+    EXPECT_EQ(s->scope->parent == NULL, 1);
+    EXPECT_EQ(s->profiler->depth, 0);
+    EXPECT_EQ(s->sampler->depth, 0);
+    EXPECT_EQ(sclisp_profile_stop(s), SCLISP_OK);
+    EXPECT_EQ(sclisp_sample_stop(s), SCLISP_OK);
+
+    sclisp_destroy(s);
+}
+
+static void test_load_errors(void)
+{
+    const char *path = "sclisp-test-truncated.lisp";
+    struct sclisp *s = NULL;
+    FILE *f;
+    char got[64];
+
+    if (sclisp_init(&s, NULL)) {
+        printf("FAIL test_load_errors: sclisp_init failed\n");
+        ++failures;
+        return;
+    }
+
+    if ((f = fopen(path, "w"))) {
+        fputs("(set a 1)\n(+ a 2", f);
+        fclose(f);
+
+        /* Forms before the truncated one still run. */
+        EXPECT_EQ(sclisp_load_file(s, path), SCLISP_ERR);
+        EXPECT_EQ(strcmp(sclisp_errmsg(s), "unterminated form"), 0);
+        describe_eval(s, "a", got);
+        EXPECT_EQ(strcmp(got, "1"), 0);
+        remove(path);
+    } else
+        EXPECT_EQ(0, 1);
+
+    EXPECT_EQ(sclisp_load_file(s, "."), SCLISP_BADARG);
+    EXPECT_EQ(s->stats.errors[SCLISP_NOMEM], 0);
+
+    sclisp_destroy(s);
+}
+
+static unsigned long fuzz_rand(unsigned long *state)
+{
+    *state = (*state * 1103515245UL + 12345UL) & 0x7fffffffUL;
+    return *state >> 8;
+}
+
+/* Mutated and truncated values must either decode to something that
+   serializes stably, or be rejected without leaving anything live. */
+static void test_serialize_fuzz(void)
+{
+    struct AllocTracker t = { 0, 0, 0, 0 };
+    struct sclisp_cb cb;
+    struct sclisp *s = NULL;
+    unsigned char *data, *mut;
+    unsigned long len = 0, state = 42, i, j;
+    int accepted = 0, rejected = 0;
+
+    cb.alloc_func = tracking_alloc_func;
+    cb.zalloc_func = tracking_zalloc_func;
+    cb.free_func = tracking_free_func;
+    cb.print_func = tracking_print_func;
+    cb.getchar_func = NULL;
+    cb.user = &t;
+
+    if (sclisp_init(&s, &cb) != SCLISP_OK) {
+        printf("FAIL test_serialize_fuzz: sclisp_init failed\n");
+        ++failures;
+        return;
+    }
+
+    sclisp_eval(s, "(set shared '(x \"y\" 3.25))");
+    sclisp_eval(s, "(list -1 0 9223372036854775807 shared shared "
+            "'(a . b) (lambda (x) (+ x 1)) car nil \"\")");
+    data = value_serialize(s, s->lr, &len);
+    if (!data || !(mut = malloc(len))) {
+        EXPECT_EQ(0, 1);
+        s->cb->free_func(s->cb, data);
+        sclisp_destroy(s);
+        return;
+    }
+
+    for (i = 0; i < 20000; ++i) {
+        unsigned long mlen = len, live = t.allocs - t.frees, len1, len2;
+        unsigned char *ser1, *ser2;
+        struct Object *obj, *again;
+        char *repr1, *repr2;
+
+        memcpy(mut, data, len);
+        for (j = fuzz_rand(&state) % 4 + 1; j; --j)
+            mut[fuzz_rand(&state) % len] = fuzz_rand(&state) & 0xff;
+        if (fuzz_rand(&state) % 4 == 0)
+            mlen = fuzz_rand(&state) % len;
+
+        s->le = SCLISP_OK;
+        if (!(obj = value_deserialize(s, mut, mlen))) {
+            if (s->le == SCLISP_OK)
+                continue; /* decoded to nil */
+            ++rejected;
+            EXPECT_EQ(t.allocs - t.frees, live);
+            continue;
+        }
+        ++accepted;
+
+        /* Serializing what was decoded reaches a fixed point after one
+           round trip, and both decodings repr the same. */
+        ser1 = value_serialize(s, obj, &len1);
+        again = ser1 ? value_deserialize(s, ser1, len1) : NULL;
+        ser2 = again ? value_serialize(s, again, &len2) : NULL;
+        EXPECT_EQ(ser2 != NULL, 1);
+        if (ser2) {
+            EXPECT_EQ(len1 == len2 && !memcmp(ser1, ser2, len1), 1);
+
+            repr1 = internal_repr(s, obj);
+            repr2 = internal_repr(s, again);
+            EXPECT_EQ(repr1 && repr2 && !strcmp(repr1, repr2), 1);
+            s->cb->free_func(s->cb, repr1);
+            s->cb->free_func(s->cb, repr2);
+        }
+
+        s->cb->free_func(s->cb, ser1);
+        s->cb->free_func(s->cb, ser2);
+        object_unref(s, again);
+        object_unref(s, obj);
+        EXPECT_EQ(t.allocs - t.frees, live);
+    }
+
+    EXPECT_EQ(accepted > 0 && rejected > 0, 1);
+
+    free(mut);
+    s->cb->free_func(s->cb, data);
+    sclisp_destroy(s);
+}
+
+/* Parses in and checks that writing it back gives expect. */
+static void json_round_trip(struct sclisp *s, const char *in,
+        const char *expect)
+{
+    char *out = NULL;
+
+    EXPECT_EQ(sclisp_json_parse(s, in, strlen(in)), SCLISP_OK);
+    EXPECT_EQ(sclisp_json_write(s, &out), SCLISP_OK);
+    if (out) {
+        EXPECT_EQ(strcmp(out, expect), 0);
+        s->cb->free_func(s->cb, out);
+    }
+}
+
+static void test_json(void)
+{
+    const char *bad[] = { "01", "-01", "1.", "1.e5", "1e", "-", ".5",
+                          "\"a\tb\"", "\"a\nb\\n\"", "[\"\x01\"]", NULL };
+    struct sclisp *s = NULL;
+    char big[128], got[64], *repr;
+    int i;
+
+    if (sclisp_init(&s, NULL)) {
+        printf("FAIL test_json: sclisp_init failed\n");
+        ++failures;
+        return;
+    }
+
+    /* Objects are tagged, so lists of pairs stay arrays. */
+    json_round_trip(s, "[[\"a\",1],[\"b\",2]]", "[[\"a\",1],[\"b\",2]]");
+    json_round_trip(s, "[[\"a\"]]", "[[\"a\"]]");
+    json_round_trip(s, "{\"a\":{},\"b\":[]}", "{\"a\":{},\"b\":[]}");
+    json_round_trip(s, "{}", "{}");
+    json_round_trip(s, "[]", "[]");
+    json_round_trip(s, "null", "null");
+    json_round_trip(s, "[null,true,false]", "[null,true,false]");
+    json_round_trip(s, "[0,-0,10,-2.5e3,1E+2]",
+            "[0,0,10,-2500.0,100.0]");
+    EXPECT_EQ(sclisp_json_parse(s, "{\"k\": null}", 11), SCLISP_OK);
+    if ((repr = internal_repr(s, s->lr))) {
+        EXPECT_EQ(strcmp(repr, "(object (\"k\" . null))"), 0);
+        s->cb->free_func(s->cb, repr);
+    }
+    describe_eval(s, "(json-write (quote (object (1 . 2))))", got);
+    EXPECT_EQ(strcmp(got, "error 4"), 0);
+
+    /* Numbers are not limited by a fixed buffer. */
+    for (i = 0; i < 100; ++i)
+        big[i] = i ? '0' + i % 10 : '1';
+    big[i] = '\0';
+    EXPECT_EQ(sclisp_json_parse(s, big, strlen(big)), SCLISP_OK);
+    EXPECT_EQ(is_real(s->lr), 1);
+    strcpy(big + 60, ".5e-3");
+    EXPECT_EQ(sclisp_json_parse(s, big, strlen(big)), SCLISP_OK);
+    EXPECT_EQ(is_real(s->lr), 1);
+
+    for (i = 0; bad[i]; ++i)
+        EXPECT_EQ(sclisp_json_parse(s, bad[i], strlen(bad[i])),
+                SCLISP_BADARG);
+
+    sclisp_destroy(s);
+}
+
+static void write_file(const char *path, const char *src)
+{
+    FILE *f = fopen(path, "w");
+
+    if (f) {
+        fputs(src, f);
+        fclose(f);
+    } else
+        EXPECT_EQ(0, 1);
+}
+
+static void test_import_errors(void)
+{
+    const char *bad = "sclisp-test-bad.lisp", *mod = "sclisp-test-coll.lisp";
+    const char *a = "(set coll 1)\n", *b = "(set coll 2)\n";
+    struct sclisp *s = NULL;
+    char *from, *to;
+    char got[64];
+    int i;
+
+    if (sclisp_init(&s, NULL)) {
+        printf("FAIL test_import_errors: sclisp_init failed\n");
+        ++failures;
+        return;
+    }
+    sclisp_add_import_path(s, ".");
+
+    /* A module that fails is not left registered half loaded. */
+    write_file(bad, "(set bad-count (+ bad-count 1))\n(car 1 2)\n");
+    sclisp_eval(s, "(set bad-count 0)");
+    for (i = 0; i < 2; ++i)
+        EXPECT_EQ(sclisp_eval(s, "(import \"sclisp-test-bad\")"),
+                SCLISP_BADARG);
+    describe_eval(s, "bad-count", got);
+    EXPECT_EQ(strcmp(got, "2"), 0);
+    EXPECT_EQ(s->modules == NULL, 1);
+    remove(bad);
+
+    /* Names are taken as they are written. */
+    write_file(mod, a);
+    EXPECT_EQ(sclisp_eval(s, "(import sclisp-test-coll)"), SCLISP_OK);
+    describe_eval(s, "coll", got);
+    EXPECT_EQ(strcmp(got, "1"), 0);
+    EXPECT_EQ(sclisp_eval(s, "(import 5)"), SCLISP_BADARG);
+    sclisp_destroy(s);
+
+    /* A cache file whose name matches is still not used for different
+       source, as if the hashes had collided. */
+    if (sclisp_init(&s, NULL)) {
+        ++failures;
+        return;
+    }
+    sclisp_add_import_path(s, ".");
+    sclisp_set_import_cache(s, ".");
+    EXPECT_EQ(sclisp_import(s, "sclisp-test-coll"), SCLISP_OK);
+    from = module_cache_path(s, sc_hash_bytes(a, strlen(a)), strlen(a));
+    to = module_cache_path(s, sc_hash_bytes(b, strlen(b)), strlen(b));
+    EXPECT_EQ(rename(from, to), 0);
+    sclisp_destroy(s);
+
+    write_file(mod, b);
+    if (!sclisp_init(&s, NULL)) {
+        sclisp_add_import_path(s, ".");
+        sclisp_set_import_cache(s, ".");
+        EXPECT_EQ(sclisp_import(s, "sclisp-test-coll"), SCLISP_OK);
+        describe_eval(s, "coll", got);
+        EXPECT_EQ(strcmp(got, "2"), 0);
+        sclisp_destroy(s);
+    } else
+        ++failures;
+
+    remove(from);
+    remove(to);
+    remove(mod);
+    free(from);
+    free(to);
+}
+
+static void test_equal(void)
+{
+    static const char *const cases[][2] = {
+        { "(equal? 1 1)", "1" }, { "(equal? 1 1.0)", "0" },
+        { "(equal? 0.0 -0.0)", "0" }, { "(equal? 2.5 2.5)", "1" },
+        { "(equal? nil nil)", "1" }, { "(equal? (list) nil)", "1" },
+        { "(equal? \"a\" (quote a))", "0" },
+        { "(equal? (quote a) (quote a))", "1" },
+        { "(equal? (cons 1 2) (cons 1 2))", "1" },
+        { "(equal? (cons 1 2) (list 1 2))", "0" },
+        { "(equal? (list 1 (list 2 \"x\") nil) (list 1 (list 2 \"x\") nil))",
+            "1" },
+        { "(equal? (list 1 (list 2 \"x\")) (list 1 (list 2 \"y\")))", "0" },
+        { "(equal? (list 1 2) (list 1 2 3))", "0" },
+        { "(equal? car car)", "1" },
+        { "(equal? (lambda (x) x) (lambda (x) x))", "0" },
+        { "(equal? 1)", "error 3" }, { "(hash 1 2)", "error 3" },
+        { "(== (hash (list 1 \"a\" (list 2.5))) "
+            "(hash (list 1 \"a\" (list 2.5))))", "1" },
+        { "(== (hash (list 1 2)) (hash (list 2 1)))", "0" },
+        { "(== (hash 1) (hash 1.0))", "0" },
+        { "(== (hash (cons 1 2)) (hash (list 1 2)))", "0" }
+    };
+    struct sclisp *s;
+    struct Object *a = NULL, *b = NULL, *c = NULL, *one;
+    unsigned long i, h = 0;
+
+    if (!(s = run_cases("test_equal", cases,
+                    sizeof(cases) / sizeof(cases[0]))))
+        return;
+
+    EXPECT_EQ(sclisp_eval(s, "(list 1 (list \"a\" 2.5))"), SCLISP_OK);
+    EXPECT_EQ(sclisp_hash(s, &h), SCLISP_OK);
+    EXPECT_EQ(sclisp_eval(s, "(hash (list 1 (list \"a\" 2.5)))"), SCLISP_OK);
+    EXPECT_EQ(s->lr->o.atom.a.integer, (long)h);
+
+    /* Deeper than the stack kept on the C stack, both ways. */
+    one = some_integer(s, 1);
+    for (i = 0; i < 2000; ++i) {
+        struct Object *t;
+
+        t = internal_cons(s, a, one);
+        object_unref(s, a);
+        a = t;
+        t = internal_cons(s, c, one);
+        object_unref(s, c);
+        c = t;
+        t = internal_cons(s, one, b);
+        object_unref(s, b);
+        b = t;
+    }
+    EXPECT_EQ(value_equal(s, a, c), 1);
+    EXPECT_EQ(value_equal(s, a, b), 0);
+    h = value_hash(s, a);
+    EXPECT_EQ(h != 0 && h == a->o.cell.hash, 1);
+    EXPECT_EQ(value_hash(s, c), h);
+    EXPECT_EQ(value_hash(s, b) == h, 0);
+    EXPECT_EQ(b->o.cell.cdr->o.cell.hash != 0, 1);
+    /* With both hashed, unequal lists differ at once. */
+    EXPECT_EQ(value_equal(s, a, b), 0);
+    EXPECT_EQ(s->le, SCLISP_OK);
+
+    object_unref(s, one);
+    object_unref(s, a);
+    object_unref(s, b);
+    object_unref(s, c);
+    sclisp_destroy(s);
+}
+
+static void test_memoize(void)
+{
+    static const char *const defs[] = {
+        "(set (fib n) (cond ((< n 2) n) (#t (+ (fib (- n 1)) (fib (- n 2))))))",
+        "(set (pair a b) (cons a b))", "(set (div a b) (/ a b))"
+    };
+    static const char *const exprs[] = {
+        "(fib 20)", "(fib 0)", "(fib nil)", "(fib 2.5)",
+        "(pair 1 2)", "(pair 1.0 2)", "(pair -0.0 2)", "(pair 0.0 2)",
+        "(pair \"a\" (quote a))", "(pair (quote a) \"a\")",
+        "(pair (list 1 (list 2 3)) nil)", "(pair (list 1 (list 2 4)) nil)",
+        "(pair (cons 1 2) (list 1 2))", "(pair nil (list nil))",
+        "(pair)", "(pair 1 2 3)", "(pair car cons)",
+        "(div 1 0)", "(div 4 2)"
+    };
+    struct sclisp *memo = NULL, *plain = NULL;
+    struct sclisp_memo_stats ms;
+    unsigned long i, hits, misses;
+
+    if (sclisp_init(&memo, NULL) || sclisp_init(&plain, NULL)) {
+        printf("FAIL test_memoize: sclisp_init failed\n");
+        ++failures;
+        return;
+    }
+
+    for (i = 0; i < sizeof(defs) / sizeof(defs[0]); ++i) {
+        sclisp_eval(memo, defs[i]);
+        sclisp_eval(plain, defs[i]);
+    }
+    EXPECT_EQ(sclisp_eval(memo, "(set fib (memoize fib))"), SCLISP_OK);
+    EXPECT_EQ(sclisp_eval(memo, "(set pair (memoize pair))"), SCLISP_OK);
+    EXPECT_EQ(sclisp_eval(memo, "(set div (memoize div 2))"), SCLISP_OK);
+
+    compare_evals("test_memoize", plain, memo, exprs,
+            sizeof(exprs) / sizeof(exprs[0]));
+
+    EXPECT_EQ(sclisp_eval(memo, "(memoize car)"), SCLISP_BADARG);
+    EXPECT_EQ(sclisp_eval(memo, "(memoize fib 0)"), SCLISP_BADARG);
+    EXPECT_EQ(sclisp_memo_stats(memo, "car", &ms), SCLISP_BADARG);
+
+    /* Each fib is computed once. */
+    EXPECT_EQ(sclisp_memo_clear(memo, "fib"), SCLISP_OK);
+    sclisp_reset_stats(memo);
+    EXPECT_EQ(sclisp_eval(memo, "(fib 60)"), SCLISP_OK);
+    EXPECT_EQ(memo->stats.function_calls, 61);
+    EXPECT_EQ(memo->stats.memo_misses, 61);
+    EXPECT_EQ(memo->stats.memo_hits, 58);
+    EXPECT_EQ(sclisp_memo_stats(memo, "fib", &ms), SCLISP_OK);
+    EXPECT_EQ(ms.entries, 61);
+    EXPECT_EQ(ms.capacity, 256);
+
+    /* Errors are not cached, and the oldest entry goes first. */
+    sclisp_eval(memo, "(memo-clear div)");
+    sclisp_memo_stats(memo, "div", &ms);
+    EXPECT_EQ(ms.entries, 0);
+    hits = ms.hits;
+    misses = ms.misses;
+    sclisp_eval(memo, "(div 1 0)");
+    sclisp_eval(memo, "(div 2 1)");
+    sclisp_eval(memo, "(div 3 1)");
+    sclisp_eval(memo, "(div 2 1)");
+    sclisp_eval(memo, "(div 4 1)");
+    sclisp_eval(memo, "(div 2 1)");
+    sclisp_eval(memo, "(div 3 1)");
+    EXPECT_EQ(sclisp_memo_stats(memo, "div", &ms), SCLISP_OK);
+    EXPECT_EQ(ms.entries, 2);
+    EXPECT_EQ(ms.misses - misses, 5);
+    EXPECT_EQ(ms.hits - hits, 2);
+
+    sclisp_destroy(memo);
+    sclisp_destroy(plain);
+}
+
+#if SCLISP_JIT_SUPPORT
+
+static void test_jit(void)
+{
+    static const char *const exprs[] = {
+        "(set add (lambda (a b) (+ a b)))",
+        "(set poly (lambda (x) (- (* x x 3) (/ x 2) 7)))",
+        "(set cmp (lambda (a b) (cond ((< a b) -1) ((> a b) 1) (#t 0))))",
+        "(set sgn (lambda (x) (cond ((< x 0) -1) ((> x 0) 1))))",
+        "(set div (lambda (a b) (/ a b)))",
+        "(set rem (lambda (a b) (mod a b)))",
+        "(set same (lambda (a b) (== a b)))",
+        "(set truth (lambda (x) (cond (x 1) (#t 2))))",
+        "(add 1 2)", "(add 1 2)", "(add 1.5 2)", "(add 2 1.5)",
+        "(add \"x\" 1)", "(add 1)", "(add 1 2 3)",
+        "(poly 4)", "(poly 4)", "(poly 4.5)", "(poly -9)",
+        "(cmp 1 2)", "(cmp 2 1)", "(cmp 2 2)", "(cmp 1.5 2)",
+        "(sgn 5)", "(sgn -5)", "(sgn 0)", "(sgn 5)",
+        "(div 7 2)", "(div -7 2)", "(div 7 0)", "(div 7 -1)",
+        "(div 7.0 2)", "(div 1 0.0)", "(div 1.0 -0.0)",
+        "(rem 7 3)", "(rem -7 3)", "(rem 7 0)", "(rem 7.5 2)",
+        "(same 1 1)", "(same 1 1.0)", "(same 0.5 0.25)", "(same 1 2)",
+        "(truth 0)", "(truth 3)", "(truth 0.0)", "(truth 0.5)",
+        /* A parameter named + shadows the builtin for callees. */
+        "(set shadow (lambda (+) (add 2 3)))", "(shadow -)", "(shadow *)",
+        "(add 2 3)",
+        /* Rebinding an operator globally invalidates compiled code. */
+        "(set + *)", "(add 3 4)", "(add 3 4)", "(set + -)", "(add 3 4)"
+    };
+    struct sclisp *jit = NULL, *interp = NULL;
+
+    if (sclisp_init(&jit, NULL) || sclisp_init(&interp, NULL)) {
+        printf("FAIL test_jit: sclisp_init failed\n");
+        ++failures;
+        return;
+    }
+
+    sclisp_jit_set_threshold(jit, 1);
+    sclisp_jit_set_threshold(interp, 0);
+
+    compare_evals("test_jit", interp, jit, exprs,
+            sizeof(exprs) / sizeof(exprs[0]));
+
+    EXPECT_EQ(jit->stats.jit_compiles > 0, 1);
+    EXPECT_EQ(jit->stats.jit_calls > 0, 1);
+    EXPECT_EQ(jit->stats.jit_bailouts > 0, 1);
+    EXPECT_EQ(jit->stats.jit_invalidations > 0, 1);
+    EXPECT_EQ(jit->op_shadows, 0);
+    EXPECT_EQ(interp->stats.jit_calls, 0);
+
+    sclisp_destroy(jit);
+    sclisp_destroy(interp);
+}
+
+#endif
+
+#if SCLISP_AOT_TESTS
+
+int aot_fixture_register(struct sclisp *s);
+
+/* The fixture compiled by sclisp-aot has to behave like the same file
+   loaded into the interpreter. */
+static void test_aot(void)
+{
+    static const char *const exprs[] = {
+        "(fib 20)", "(fib 10.0)", "(fib nil)", "(fib \"x\")",
+        "(poly 4 10)", "(poly 2.5 -3)", "(poly nil 1)",
+        "(square 1.5)", "(hyp 3 4)", "(hyp 3 4.0)",
+        "(safe-div 7 0)", "(safe-div 7 2)", "(safe-div 7.0 2)",
+        "(sign -3)", "(sign 0)", "(sign 0.5)",
+        "(is-small? 3)", "(is-small? 30)", "(one)", "(ignore 5)",
+        "(both 1 0)", "(both 6 3)", "(both 6 3.0)",
+        "(rem 7 0)", "(rem -7 3)", "(rem 7.5 2)", "(rem 7 0.0)",
+        "(inv 4)", "(inv 4.0)", "(inv 0)", "(limits)",
+        "(twice 3)", "(greet \"x\")", "label",
+        /* Compiled functions are ordinary values to interpreted code. */
+        "((lambda (f) (f 5)) square)", "(hyp (fib 5) (twice 1))"
+    };
+    struct sclisp *compiled = NULL, *loaded = NULL;
+    struct Object *obj;
+
+    if (sclisp_init(&compiled, NULL) || sclisp_init(&loaded, NULL)) {
+        printf("FAIL test_aot: sclisp_init failed\n");
+        ++failures;
+        return;
+    }
+
+    EXPECT_EQ(aot_fixture_register(compiled), SCLISP_OK);
+    EXPECT_EQ(sclisp_load_file(loaded, SCLISP_AOT_FIXTURE), SCLISP_OK);
+
+    compare_evals("test_aot", loaded, compiled, exprs,
+            sizeof(exprs) / sizeof(exprs[0]));
+
+    obj = NULL;
+    scope_query(compiled, compiled->scope, "fib", &obj);
+    EXPECT_EQ(is_atom(obj) && obj->o.atom.tag == BUILTIN, 1);
+    object_unref(compiled, obj);
+    obj = NULL;
+    scope_query(compiled, compiled->scope, "twice", &obj);
+    EXPECT_EQ(is_atom(obj) && obj->o.atom.tag == FUNCTION, 1);
+    object_unref(compiled, obj);
+
+    /* Unlike interpreted code, compiled code only takes numbers. */
+    EXPECT_EQ(sclisp_eval(compiled, "(sign \"x\")"), SCLISP_BADARG);
+
+    sclisp_destroy(compiled);
+    sclisp_destroy(loaded);
+}
+
+#endif
+
+int sclisp_test_internal(void)
 {
     /* TODO: Internal testing. Refactor into several functions. */
 
@@ -142,18 +1394,18 @@ void sclisp_test_internal(void)
     sclisp_init(&_s, NULL);
     if (!_s) {
         printf("internal tests: sclisp_init failed\n");
-        return;
+        return 1;
     }
 
     scope_set(_s, _s->scope, "foo", NULL);
 
-    res = scope_query(_s->scope, "foo", &obj);
+    res = scope_query(_s, _s->scope, "foo", &obj);
     sc_printf(_s->cb, SCLISP_STDOUT, "'foo' -> (%d, %p)\n", res, obj);
-    res = scope_query(_s->scope, "bar", &obj);
+    res = scope_query(_s, _s->scope, "bar", &obj);
     sc_printf(_s->cb, SCLISP_STDOUT, "'bar' -> (%d, %p)\n", res, obj);
-    res = scope_query(_s->scope, "bas", &obj);
+    res = scope_query(_s, _s->scope, "bas", &obj);
     sc_printf(_s->cb, SCLISP_STDOUT, "'bas' -> (%d, %p)\n", res, obj);
-    res = scope_query(_s->scope, "foo", &obj);
+    res = scope_query(_s, _s->scope, "foo", &obj);
     sc_printf(_s->cb, SCLISP_STDOUT, "'foo' -> (%d, %p)\n", res, obj);
 
     three = some_integer(_s, 3);
@@ -241,4 +1493,27 @@ void sclisp_test_internal(void)
     internal_eval(_s, parsed_obj);
 
     sclisp_destroy(_s);
+
+    test_alloc_counts();
+    test_census();
+    test_specialize();
+    test_fold();
+    test_inline();
+    test_equal();
+    test_memoize();
+    test_macro();
+    test_quasiquote();
+    test_try();
+    test_load_errors();
+    test_json();
+    test_serialize_fuzz();
+    test_import_errors();
+#if SCLISP_JIT_SUPPORT
+    test_jit();
+#endif
+#if SCLISP_AOT_TESTS
+    test_aot();
+#endif
+
+    return failures;
 }
@@ -27,9 +27,15 @@
 
 int main(void)
 {
-    sclisp_test_internal();
+    int failures = sclisp_test_internal();
+
     sclisp_test_external();
 
+    if (failures) {
+        printf("Failed: %d\n", failures);
+        return 1;
+    }
+
     printf("Ok\n");
 
     return 0;
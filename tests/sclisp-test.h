@@ -28,7 +28,7 @@
 extern "C" {
 #endif
 
-void sclisp_test_internal(void);
+int sclisp_test_internal(void);
 void sclisp_test_external(void);
 
 #ifdef __cplusplus